@@ -27,7 +27,8 @@
 //   • Voltage-based percent only
 //       - Percent derived exclusively from smoothed voltage
 //       - V_EMPTY fixed (target 0%), V_FULL learned automatically
-//       - Gamma curve to visually linearize discharge behavior
+//       - Gamma curve to visually linearize discharge behavior, or a per-chemistry OCV shape
+//       - Curve and droop precomputed into tables, rebuilt only when the map values change
 //
 //   • Median-of-3 + EMA smoothing
 //       - Filters jitter from battery load and charger noise
@@ -37,63 +38,145 @@
 //
 //   • Adaptive V_FULL learning
 //       - Updates V_FULL once using smoothed (EMA) voltage when status == "Full"
-//       - Saves map file atomically
+//       - Map file written atomically and fsync'ed, at most every 15 min and on SIGTERM
 //
 //   • Calm percent exposure (UI-friendly)
-//       - Internal percent updated every INTERNAL_INTERVAL_S
+//       - Internal percent updated every INTERNAL_INTERVAL_S while charging, at low percent and after
+//         charger/resume events; otherwise adaptively (5-60 s) from the discharge slope and the
+//         distance to the next 5% hook bucket
 //       - Visible percent written only every WRITE_INTERVAL (halved under LOW_PCT_THRESHOLD)
 //       - On large resume jump (>=3%), snap to internal immediately
 //       - On small delta, smoothly catch up
 //
+//   • Discharge rate and time remaining
+//       - Every sample is kept in a shared-memory ring buffer
+//       - Exponentially weighted regression (30 min time constant) of EMA mV and percent over time,
+//         updated incrementally per sample: mV/hour, time to empty / full in the export record
+//
+//   • Multiple supplies
+//       - The primary battery plus up to 3 more (second cell, dock, controllers), added and removed
+//         on power_supply uevents; each has its own smoothing, learned map, history and export record
+//       - All sampled in one tick at the interval the busiest one needs
+//       - PERCENT_FILE and hooks follow the primary battery only
+//
 //   • Hooks system (5% buckets)
 //       - Runs scripts in /etc/batteryplus/{charging.d|discharging.d}/
 //       - Based on visible percent bucket changes
+//       - posix_spawn'ed and supervised via pidfd in the event loop, killed after 2 s
+//       - One at a time per directory; a newer bucket drops hooks still queued for an older one
+//       - Directories are cached once and kept up to date via inotify, no restart needed
 //
 // Files:
-//   /tmp/battery.percent                 - exported visible % for UI polling
-//   /userdata/system/batteryplus-voltage.map - stores V_FULL, V_EMPTY, and V_DROOP
+//   /tmp/battery.percent                 - exported visible % for UI polling (compatibility)
+//   /dev/shm/batteryplus                 - ExportRecord, updated every sample, read without syscalls:
+//                                          read seq, copy, read seq again; retry if odd or changed
+//   /dev/shm/batteryplus-history         - HistoryHeader + ring of HISTORY_CAPACITY HistoryRecords, one per sample;
+//                                          the newest is recs[(head - 1) % capacity]
+//   /dev/shm/batteryplus{,-history}.ID   - the same for other supplies, ID = name[-serial_number]
+//   /tmp/batteryplus.sock                - line per visible percent or charging change of any supply:
+//                                          "percent=N internal=N ema_mv=N charging=0|1 seq=N mv_h=N tte_min=N ttf_min=N
+//                                          supply=NAME"
+//   /etc/batteryplus/curve               - optional curve profile: a name (gamma, li-ion, lifepo4)
+//                                          or "pos percent" lines, pos = 0-100 across the voltage window
+//   /userdata/system/batteryplus-voltage.map - stores V_FULL, V_EMPTY, and V_DROOP after a CRC32 line;
+//                                          remove that line after editing by hand
+//   /userdata/system/batteryplus-voltage.ID.map - the same for other supplies
 //
 // Build:
 //   aarch64-linux-gnu-g++ -O3 -flto -std=gnu++20 -Wall -Wextra -pedantic batteryplus.cpp -o batteryplus
 //
+// Idle coupling:
+//   /var/run/idlewatcher.sock            - IdleWatcher's state lines, subscribed to (retried every minute):
+//                                          while IDLE / EXTENDED discharge is sampled every 120 / 300 s
+//                                          (60 s at low percent), back to ACTIVE resamples at once and lets
+//                                          the visible percent snap as after a reset (hooks don't rerun)
+//   ../Knubatd/knubatd.cpp builds this file and IdleWatcher into one process on one epoll loop and
+//   passes the state in directly instead
+//
+// Simulator:
+//   batteryplus simulate [TRACE] [--map FILE] [--curve FILE]
+//   runs the smoothing pipeline over a recorded or synthetic trace on a virtual clock and reports
+//   CPU per sample, convergence latency, percent error and write/hook counts (see Simulator below)
+//
+//
+// Event loop:
+//   epoll on a timerfd (one wakeup per sample) and a signalfd, no polling sleeps
+//   power_supply uevents (charger plug/unplug, battery status change) resample immediately;
+//   the timer only has to track voltage
+//   the timerfd runs on CLOCK_BOOTTIME, so a tick that came due during suspend fires right at resume;
+//   BOOTTIME - MONOTONIC growing by SUSPEND_DETECT_MS or more between wakeups means we slept, and the
+//   sample runs the SIGUSR1 reset path on its own
 //
 // Signals:
-//   SIGTERM / SIGINT — stop daemon
-//   SIGUSR1          — reset; triggers snap if delta is over threshold (i.e. can be used when resuming from suspend)
+//   SIGTERM / SIGINT — flush learned map values, stop daemon
+//   SIGUSR1          — reset; samples at once and triggers snap if delta is over threshold (done automatically
+//                      after suspend, still useful for other jumps)
+//   SIGUSR2          — dump counters and latency histograms to stderr; "stats" sent on the socket
+//                      replies with the same
 
 #include <algorithm>
-#include <atomic>
 #include <array>
-#include <chrono>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
 #include <cmath>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fcntl.h>
+#include <linux/netlink.h>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
 #include <optional>
+#include <spawn.h>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <thread>
 #include <unistd.h>
 #include <vector>
 
+#undef MAP_FILE // <sys/mman.h> compatibility flag (0), the name is taken by the map path below
+
 namespace fs = std::filesystem;
-using namespace std::chrono_literals;
 
 // ========================= Config (constants) =========================
 static constexpr const char* MAP_FILE = "/userdata/system/batteryplus-voltage.map";
 static constexpr const char* PERCENT_FILE = "/tmp/battery.percent";
+static constexpr bool EXPORT_PERCENT_FILE = true; // compatibility for pollers of PERCENT_FILE
+static constexpr const char* EXPORT_SHM = "/batteryplus"; // shm_open() name, /dev/shm/batteryplus
+static constexpr const char* EXPORT_SOCKET = "/tmp/batteryplus.sock"; // change notifications
+static constexpr int EXPORT_MAX_CLIENTS = 8;
+static constexpr const char* HISTORY_SHM = "/batteryplus-history"; // tmpfs: kept across daemon restarts, no flash wear
+static constexpr uint32_t HISTORY_CAPACITY = 4096; // records, 64 KiB, ~11-68 h depending on the interval
 static constexpr const char* ROOT = "/etc/batteryplus"; // use {charging.d, discharging.d}
+static constexpr int MAX_SUPPLIES = 4; // primary battery + extra cells / controllers
+static constexpr const char* CURVE_FILE = "/etc/batteryplus/curve"; // optional, overrides DEFAULT_CURVE
+static constexpr const char* DEFAULT_CURVE = "gamma"; // gamma, li-ion, lifepo4
+static constexpr const char* IDLEWATCHER_SOCKET = "/var/run/idlewatcher.sock"; // IdleWatcher's state_socket=
 
 // Timers
 static constexpr int INTERNAL_INTERVAL_S = 10; // how often internal calculations are done in seconds
-static constexpr int CHARGE_FULL_FALLBACK_TICKS = 30 * 60 / INTERNAL_INTERVAL_S; // 30min at 10s intervals
+static constexpr int CHARGE_FULL_FALLBACK_TICKS = 30 * 60 / INTERNAL_INTERVAL_S; // 30min at 10s intervals (charging always samples at 10s)
+static constexpr int SAMPLE_MIN_S = 5; // about to cross a hook bucket
+static constexpr int SAMPLE_MAX_S = 60; // flat voltage, far from the next bucket
+static constexpr int IDLE_SAMPLE_S = 120; // discharging while IdleWatcher reports IDLE
+static constexpr int EXTENDED_SAMPLE_S = 300; // discharging while IdleWatcher reports EXTENDED
+static constexpr int IDLEWATCHER_RETRY_S = 60; // reconnect to IDLEWATCHER_SOCKET at most this often
+static constexpr int SETTLE_SAMPLES = 6; // samples at INTERNAL_INTERVAL_S after charger changes and resets
+static constexpr int SUSPEND_DETECT_MS = 2000; // slept at least this long since the last wakeup = resume reset
 
 // Percent write parameters
 static constexpr int LOW_PCT_THRESHOLD = 10; // threshold where we update faster (%)
@@ -108,30 +191,44 @@ static constexpr int DEFAULT_V_FULL = 4000; // mV (absolute ceiling, learned per
 static constexpr int DEFAULT_V_EMPTY = 3250; // mV (fixed, never learned)
 static constexpr int DEFAULT_V_DROOP = 50; // mV (offset applied while charging, learned per device)
 
-// ========================= Globals =========================
-static std::atomic<bool> g_running { true };
-static std::atomic<bool> g_reset{false};
-
 // ========================= Utilities =========================
-static void handle_reset(int) { g_reset = true; }
+// A sysfs attribute kept open for the daemon's lifetime and re-read with pread() from offset 0
+struct SysfsAttr {
+    std::string path;
+    int fd = -1;
+};
 
-static std::optional<std::string> slurp(const fs::path& p) {
-    std::ifstream f(p);
-    if (!f) return std::nullopt;
-    std::string s;
-    std::getline(f, s);
-    if (!f && !f.eof()) return std::nullopt;
-    // strip CR/LF/space
-    while (!s.empty() && (s.back()=='\n' || s.back()=='\r' || s.back()==' ' || s.back()=='\t')) s.pop_back();
-    return s;
-}
-
-static std::optional<int> slurp_int(const fs::path& p) {
-    auto s = slurp(p);
-    if (!s) return std::nullopt;
+static void close_attr(SysfsAttr& a) {
+    if (a.fd >= 0) ::close(a.fd);
+    a.fd = -1;
+}
+
+// Reads the first line into buf (NUL-terminated, trailing whitespace stripped), -1 on failure.
+// A read error (ENODEV once the power_supply is gone) drops the fd and reopens the path once.
+static int read_attr(SysfsAttr& a, char* buf, size_t size) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (a.fd < 0) {
+            a.fd = ::open(a.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (a.fd < 0) return -1;
+        }
+        ssize_t n = ::pread(a.fd, buf, size - 1, 0);
+        if (n >= 0) {
+            // strip CR/LF/space
+            while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r' || buf[n - 1] == ' ' || buf[n - 1] == '\t')) --n;
+            buf[n] = '\0';
+            return (int)n;
+        }
+        close_attr(a);
+    }
+    return -1;
+}
+
+static std::optional<int> read_attr_int(SysfsAttr& a) {
+    char buf[32];
+    if (read_attr(a, buf, sizeof(buf)) <= 0) return std::nullopt;
     char* end=nullptr;
-    long v = std::strtol(s->c_str(), &end, 10);
-    if (end==s->c_str()) return std::nullopt;
+    long v = std::strtol(buf, &end, 10);
+    if (end==buf) return std::nullopt;
     return static_cast<int>(v);
 }
 
@@ -169,62 +266,61 @@ static int median3(int a, int b, int c) {
     return b;
 }
 
-static std::string read_charge_status(const fs::path& status_path) {
-    auto s = slurp(status_path);
-    if (!s) return "Unknown";
-    return *s;
-}
+enum class ChargeStatus { Unknown, Charging, Discharging, NotCharging, Full };
 
-// ========================= Hook System =========================
-// Execute all executables in {charging|discharging}.d whose filename starts with the battery% number.
-// Supports plain and zero-padded, e.g., "50", "050", "50-".
-// Wildcards: filenames that do NOT start with a digit run on every bucket change.
+static ChargeStatus parse_charge_status(const char* s) {
+    if (std::strncmp(s, "Charging", 8) == 0) return ChargeStatus::Charging;
+    if (std::strncmp(s, "Full", 4) == 0) return ChargeStatus::Full;
+    if (std::strncmp(s, "Discharging", 11) == 0) return ChargeStatus::Discharging;
+    if (std::strncmp(s, "Not charging", 12) == 0) return ChargeStatus::NotCharging;
+    return ChargeStatus::Unknown;
+}
 
-static bool is_executable(const fs::directory_entry& de) {
-    if (!de.is_regular_file()) return false;
-    return ::access(de.path().c_str(), X_OK) == 0;
+static ChargeStatus read_charge_status(SysfsAttr& status) {
+    char buf[32];
+    if (read_attr(status, buf, sizeof(buf)) <= 0) return ChargeStatus::Unknown;
+    return parse_charge_status(buf);
 }
 
-static int run_hook_file(const fs::path& file) {
-    pid_t pid = ::fork();
-    if (pid < 0) return -1;
+// ========================= Stats =========================
+// Counters and log2 histograms, fixed size and bumped in place; dumped on SIGUSR2 (stderr) or
+// in reply to "stats" on the export socket
+struct Histogram {
+    uint32_t bucket[16]; // [0] < 2, [i] in [2^i, 2^(i+1)), [15] everything above
+    uint64_t count, sum, max;
+};
 
-    if (pid == 0) {
-        // child
-        int nullfd = ::open("/dev/null", O_RDWR);
-        if (nullfd >= 0) {
-            ::dup2(nullfd, STDOUT_FILENO);
-            ::dup2(nullfd, STDERR_FILENO);
-            ::close(nullfd);
-        }
-        const char* argv[] = { file.c_str(), nullptr };
-        ::execv(argv[0], (char* const*)argv);
-        _exit(127);
-    }
+static inline void hist_add(Histogram& h, uint64_t v) {
+    int b = v < 2 ? 0 : 63 - __builtin_clzll(v);
+    h.bucket[std::min(b, 15)]++;
+    h.count++;
+    h.sum += v;
+    if (v > h.max) h.max = v;
+}
 
-    // parent: wait with timeout
-    int status = 0;
-    constexpr int MAX_MS = 2000; // max time to wait for a hook before terminating it
-    constexpr int STEP_MS = 50; // polling interval to check the hook process
+struct Stats {
+    int64_t started_ms;
+    uint64_t samples, invalid_reads, ema_wipes;
+    uint64_t visible_written, visible_deferred; // deferred: internal moved, WRITE_INTERVAL not up yet
+    uint64_t resets, resumes, uevent_resamples;
+    uint64_t hooks_spawned, hooks_failed, hooks_dropped, hooks_killed;
+    uint64_t map_flushes, map_flush_skipped, map_flush_failed;
+    Histogram sysfs_us; // status + voltage_now reads of one sample
+    Histogram step_us; // pipeline_step()
+    Histogram hook_ms; // spawn to reap, hooks run beside the loop
+};
+static Stats g_stats;
 
-    int waited = 0;
-    while (waited < MAX_MS) {
-        pid_t r = ::waitpid(pid, &status, WNOHANG);
-        if (r == pid) {
-            // child finished
-            return status;
-        } else if (r < 0) {
-            // wait error
-            return -1;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(STEP_MS));
-        waited += STEP_MS;
-    }
+// ========================= Hook System =========================
+// Execute all executables in {charging|discharging}.d whose filename starts with the battery% number.
+// Supports plain and zero-padded, e.g., "50", "050", "50-".
+// Wildcards: filenames that do NOT start with a digit run on every bucket change.
 
-    // Timeout: kill the hook
-    ::kill(pid, SIGKILL);
-    (void)::waitpid(pid, &status, 0);
-    return -1;
+// Checked once when the cache is built, hooks are spawned without further checks
+static bool is_executable(const fs::path& p) {
+    std::error_code ec;
+    if (!fs::is_regular_file(p, ec)) return false;
+    return ::access(p.c_str(), X_OK) == 0;
 }
 
 static constexpr int NUM_BUCKETS = 21; // 0 -> 100 in 5% increments
@@ -248,10 +344,12 @@ static inline int bucket_index(int percent) {
 
 static void scan_hook_dir(const fs::path& dir, std::array<std::vector<fs::path>, NUM_BUCKETS>& buckets, std::vector<fs::path>& wildcards)
 {
-    if (!fs::exists(dir) || !fs::is_directory(dir)) return;
+    for (auto& v : buckets) v.clear();
+    wildcards.clear();
 
-    for (auto& de : fs::directory_iterator(dir)) {
-        if (!is_executable(de)) continue;
+    std::error_code ec; // may run while the directory is being changed under us
+    for (auto& de : fs::directory_iterator(dir, ec)) {
+        if (!is_executable(de.path())) continue;
         const std::string fname = de.path().filename().string();
 
         int n = parse_leading_bucket(fname); // numeric prefix
@@ -279,11 +377,202 @@ static void load_hook_cache(HookCache& hc) {
     hc.loaded = true;
 }
 
-static inline void run_paths(const std::vector<fs::path>& paths) {
-    for (const auto& p : paths) {
-        if (::access(p.c_str(), X_OK) == 0)
-            run_hook_file(p);
+// One file in charging.d/discharging.d changed: drop it from its list and put it back, sorted,
+// if it is (still) an executable regular file
+static void update_hook_entry(HookCache& hc, bool charging, const char* name) {
+    const fs::path path = fs::path(ROOT) / (charging ? "charging.d" : "discharging.d") / name;
+    int n = parse_leading_bucket(name);
+    if (n > 100 || (n >= 0 && n % 5 != 0)) return; // never cached
+
+    auto& v = n >= 0 ? (charging ? hc.charging : hc.discharging)[bucket_index(n)]
+                     : (charging ? hc.charging_any : hc.discharging_any);
+    auto it = std::lower_bound(v.begin(), v.end(), path);
+    const bool cached = it != v.end() && *it == path;
+    const bool wanted = is_executable(path);
+    if (cached && !wanted) v.erase(it);
+    else if (!cached && wanted) v.insert(it, path);
+}
+
+// ========================= Hook supervisor =========================
+// Hooks are posix_spawn'ed and never waited on inline: each child's pidfd sits in the event loop,
+// a timerfd enforces HOOK_TIMEOUT_MS. A new bucket replaces whatever is still queued, so rapid
+// bucket changes only run the latest one. At most HOOK_MAX_PARALLEL run per directory.
+static constexpr int HOOK_TIMEOUT_MS = 2000; // max time for a hook before it is killed
+static constexpr int HOOK_MAX_PARALLEL = 1; // per directory, 1 keeps the sorted order
+static constexpr int HOOK_REAP_POLL_MS = 250; // only used when pidfd_open() is unavailable
+
+enum HookDirIdx { HD_CHARGING, HD_DISCHARGING, HD_COUNT };
+
+struct HookChild {
+    pid_t pid;
+    int pidfd; // -1 without pidfd_open(), reaped by polling
+    int dir;
+    int64_t started_ms;
+    int64_t deadline_ms;
+    bool killed;
+};
+
+struct HookSupervisor {
+    int epfd = -1;
+    int timer_fd = -1;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    std::array<std::deque<fs::path>, HD_COUNT> queue;
+    std::vector<HookChild> running;
+};
+static HookSupervisor g_hooks;
+
+static inline int64_t mono_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline int64_t mono_us() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Total time spent suspended since boot
+static inline int64_t suspended_ms() {
+    timespec b{}, m{};
+    clock_gettime(CLOCK_BOOTTIME, &b);
+    clock_gettime(CLOCK_MONOTONIC, &m);
+    return ((int64_t)b.tv_sec - m.tv_sec) * 1000 + (b.tv_nsec - m.tv_nsec) / 1000000;
+}
+
+// epoll_event.data.u64 of every registration: EP_OWNER plus the fd, so an epoll set shared with
+// another module (knubatd) routes on the owner bit instead of guessing from the fd
+static constexpr uint64_t EP_OWNER = 1ull << 41;
+static inline uint64_t ep_tag(int fd) { return EP_OWNER | (uint32_t)fd; }
+
+static inline int pidfd_open_compat(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)::syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid; errno = ENOSYS; return -1;
+#endif
+}
+
+// Children start with default dispositions, an empty mask (the daemon blocks its signals for the
+// signalfd) and stdout/stderr on /dev/null
+static bool init_hook_supervisor(int epfd) {
+    g_hooks.epfd = epfd;
+    g_hooks.timer_fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_hooks.timer_fd < 0) return false;
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = ep_tag(g_hooks.timer_fd);
+    if (::epoll_ctl(epfd, EPOLL_CTL_ADD, g_hooks.timer_fd, &ev) < 0) return false;
+
+    sigset_t none, defaults;
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTERM);
+    sigaddset(&defaults, SIGUSR1);
+    sigaddset(&defaults, SIGUSR2);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&g_hooks.attr);
+    posix_spawnattr_setsigmask(&g_hooks.attr, &none);
+    posix_spawnattr_setsigdefault(&g_hooks.attr, &defaults);
+    posix_spawnattr_setflags(&g_hooks.attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    posix_spawn_file_actions_init(&g_hooks.actions);
+    posix_spawn_file_actions_addopen(&g_hooks.actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&g_hooks.actions, STDOUT_FILENO, STDERR_FILENO);
+    return true;
+}
+
+static bool spawn_hook(const fs::path& file, int dir, int64_t now) {
+    char* const argv[] = { const_cast<char*>(file.c_str()), nullptr };
+    pid_t pid;
+    if (::posix_spawn(&pid, file.c_str(), &g_hooks.actions, &g_hooks.attr, argv, environ) != 0) {
+        g_stats.hooks_failed++;
+        return false;
     }
+    g_stats.hooks_spawned++;
+
+    HookChild c{pid, pidfd_open_compat(pid), dir, now, now + HOOK_TIMEOUT_MS, false};
+    if (c.pidfd >= 0) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = ep_tag(c.pidfd);
+        if (::epoll_ctl(g_hooks.epfd, EPOLL_CTL_ADD, c.pidfd, &ev) < 0) { ::close(c.pidfd); c.pidfd = -1; }
+    }
+    g_hooks.running.push_back(c);
+    return true;
+}
+
+static void arm_hook_timer(int64_t now) {
+    int64_t next = 0;
+    for (auto& c : g_hooks.running) {
+        int64_t at = c.killed ? 0 : c.deadline_ms;
+        if (c.pidfd < 0) at = at ? std::min(at, now + HOOK_REAP_POLL_MS) : now + HOOK_REAP_POLL_MS;
+        if (at && (next == 0 || at < next)) next = at;
+    }
+    itimerspec its{}; // zero disarms
+    if (next > 0) {
+        int64_t ms = std::max<int64_t>(next - now, 1);
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    }
+    ::timerfd_settime(g_hooks.timer_fd, 0, &its, nullptr);
+}
+
+static void pump_hooks(int64_t now) {
+    for (int dir = 0; dir < HD_COUNT; ++dir) {
+        auto& q = g_hooks.queue[dir];
+        int active = (int)std::count_if(g_hooks.running.begin(), g_hooks.running.end(),
+                                        [&](const HookChild& c) { return c.dir == dir; });
+        while (!q.empty() && active < HOOK_MAX_PARALLEL) {
+            if (spawn_hook(q.front(), dir, now)) ++active;
+            q.pop_front();
+        }
+    }
+    arm_hook_timer(now);
+}
+
+// Reap finished children, kill overdue ones, start what's queued next
+static void reap_hooks() {
+    const int64_t now = mono_ms();
+    for (size_t i = 0; i < g_hooks.running.size(); ) {
+        HookChild& c = g_hooks.running[i];
+        int status;
+        if (::waitpid(c.pid, &status, WNOHANG) != 0) { // exited, or not ours any more
+            if (c.pidfd >= 0) ::close(c.pidfd);
+            hist_add(g_stats.hook_ms, now - c.started_ms);
+            c = g_hooks.running.back();
+            g_hooks.running.pop_back();
+            continue;
+        }
+        if (!c.killed && now >= c.deadline_ms) {
+            ::kill(c.pid, SIGKILL); // still a zombie at worst, the pid can't be reused yet
+            c.killed = true;
+            g_stats.hooks_killed++;
+        }
+        ++i;
+    }
+    pump_hooks(now);
+}
+
+static bool is_hook_fd(int fd) {
+    if (fd == g_hooks.timer_fd) return true;
+    for (auto& c : g_hooks.running) if (c.pidfd == fd) return true;
+    return false;
+}
+
+// Replace everything still queued with these lists for one directory
+static void queue_hooks(bool charging, const std::vector<fs::path>& a, const std::vector<fs::path>* b = nullptr) {
+    for (auto& q : g_hooks.queue) {
+        g_stats.hooks_dropped += q.size();
+        q.clear();
+    }
+    auto& q = g_hooks.queue[charging ? HD_CHARGING : HD_DISCHARGING];
+    q.insert(q.end(), a.begin(), a.end());
+    if (b) q.insert(q.end(), b->begin(), b->end());
+    pump_hooks(mono_ms());
 }
 
 static void run_bucket_hooks_cached(const HookCache& hc, bool charging, int percent_value) {
@@ -292,117 +581,253 @@ static void run_bucket_hooks_cached(const HookCache& hc, bool charging, int perc
     const auto& buckets = charging ? hc.charging : hc.discharging;
     const auto& any     = charging ? hc.charging_any : hc.discharging_any;
 
-    run_paths(buckets[bi]); // run all scripts for this 5% bucket
-    run_paths(any); // wildcard scripts every change
+    queue_hooks(charging, buckets[bi], &any); // scripts for this 5% bucket, then wildcards
 }
 
 // ========================= Battery discovery =========================
 struct BatteryPaths {
-    fs::path status;
-    fs::path voltage_now;
+    std::string name; // power_supply directory, matches POWER_SUPPLY_NAME in uevents
+    std::string ident; // name[-serial_number], file-name safe; keys the map, shm and history
+    SysfsAttr status;
+    SysfsAttr voltage_now;
 };
 
-static std::optional<BatteryPaths> find_battery() {
-    auto has_required = [](const fs::path& d){
-        return fs::exists(d/"status") && fs::exists(d/"voltage_now");
-    };
+static bool has_required(const fs::path& d) {
+    std::error_code ec;
+    return fs::exists(d/"status", ec) && fs::exists(d/"voltage_now", ec);
+}
+
+static std::string read_small_file(const fs::path& p) {
+    std::ifstream f(p);
+    std::string v;
+    if (f) std::getline(f, v);
+    while (!v.empty() && std::isspace((unsigned char)v.back())) v.pop_back();
+    return v;
+}
+
+static BatteryPaths battery_paths(const fs::path& d) {
+    BatteryPaths bp;
+    bp.name = d.filename().string();
+    bp.status.path = (d/"status").string();
+    bp.voltage_now.path = (d/"voltage_now").string();
+
+    bp.ident = bp.name;
+    std::string serial = read_small_file(d/"serial_number");
+    if (!serial.empty()) bp.ident += "-" + serial;
+    for (char& c : bp.ident) {
+        if (!std::isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.') c = '_';
+    }
+    return bp;
+}
+
+// Batteries beside the primary one: second cells, docks, controllers (scope Device)
+static bool is_extra_battery(const fs::path& d) {
+    if (!has_required(d)) return false;
+    std::string type = read_small_file(d/"type");
+    return type.empty() || type == "Battery";
+}
+
+// Primary first (name matching BAT/FUEL, else any supply with status and voltage_now), then the
+// other batteries, at most MAX_SUPPLIES
+static std::vector<BatteryPaths> find_batteries() {
+    std::vector<BatteryPaths> out;
 
     std::vector<std::string> patterns = {
         "BAT", "bat", "FUEL", "fuel"
     };
 
     fs::path base("/sys/class/power_supply");
-    if (!fs::exists(base)) return std::nullopt;
+    std::error_code ec;
+    if (!fs::exists(base, ec)) return out;
+
+    std::vector<fs::path> dirs;
+    for (auto& de : fs::directory_iterator(base, ec)) dirs.push_back(de.path());
+    std::sort(dirs.begin(), dirs.end()); // BAT0 before BAT1
 
-    for (auto& de : fs::directory_iterator(base)) {
-        std::string name = de.path().filename().string();
+    for (auto& d : dirs) {
+        std::string name = d.filename().string();
         bool match = false;
         for (auto& p : patterns) {
             if (name.find(p) != std::string::npos) { match = true; break; }
         }
-        if (!match) continue;
-        if (has_required(de.path())) {
-            BatteryPaths bp;
-            bp.status = de.path()/"status";
-            bp.voltage_now = de.path()/"voltage_now";
-            return bp;
+        if (match && has_required(d)) {
+            out.push_back(battery_paths(d));
+            break;
         }
     }
 
     // Fallback: any power_supply that has required files
-    for (auto& de : fs::directory_iterator(base)) {
-        if (has_required(de.path())) {
-            BatteryPaths bp;
-            bp.status = de.path()/"status";
-            bp.voltage_now = de.path()/"voltage_now";
-            return bp;
+    if (out.empty()) {
+        for (auto& d : dirs) {
+            if (has_required(d)) {
+                out.push_back(battery_paths(d));
+                break;
+            }
         }
     }
+    if (out.empty()) return out;
 
-    return std::nullopt;
+    for (auto& d : dirs) {
+        if ((int)out.size() >= MAX_SUPPLIES) break;
+        if (d.filename() == out.front().name || !is_extra_battery(d)) continue;
+        out.push_back(battery_paths(d));
+    }
+    return out;
 }
 
 // ========================= Map file =========================
+// Learned values are batched in RAM and flushed at most every MAP_FLUSH_INTERVAL_S (and on
+// SIGTERM/SIGINT): /userdata is SD/eMMC. The record starts with a CRC32 of the lines after it, so a
+// torn or hand-edited file is detected and ignored (defaults in memory) without touching the card.
+static constexpr int MAP_FLUSH_INTERVAL_S = 15 * 60;
+
 struct MapVals {
     int V_FULL = DEFAULT_V_FULL;
     int V_EMPTY = DEFAULT_V_EMPTY;
     int V_DROOP = DEFAULT_V_DROOP;
+
+    bool operator==(const MapVals&) const = default;
 };
 
-static void save_map_atomic(const fs::path& path, const MapVals& m) {
-    std::string data;
-    data += "V_FULL=" + std::to_string(m.V_FULL) + "\n";
-    data += "V_EMPTY=" + std::to_string(m.V_EMPTY) + "\n";
-    data += "V_DROOP=" + std::to_string(m.V_DROOP) + "\n";
-    fs::create_directories(path.parent_path());
-    (void)write_atomic(path, data, 0644);
+struct MapStore {
+    std::string path;
+    MapVals flushed; // what the file holds, valid when on_disk
+    bool on_disk = false; // file exists in the current format
+    bool dirty = false;
+    int64_t dirty_since_ms = 0;
+};
+
+static uint32_t crc32(const char* p, size_t n) {
+    uint32_t c = 0xffffffffu;
+    for (size_t i = 0; i < n; ++i) {
+        c ^= (unsigned char)p[i];
+        for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0xedb88320u & (0u - (c & 1u)));
+    }
+    return ~c;
 }
 
-static MapVals load_map(const fs::path& path) {
+static std::string format_map(const MapVals& m) {
+    std::string body;
+    body += "V_FULL=" + std::to_string(m.V_FULL) + "\n";
+    body += "V_EMPTY=" + std::to_string(m.V_EMPTY) + "\n";
+    body += "V_DROOP=" + std::to_string(m.V_DROOP) + "\n";
+    char head[32];
+    std::snprintf(head, sizeof(head), "CRC32=%08x\n", crc32(body.data(), body.size()));
+    return head + body;
+}
+
+// tmp + fsync + rename + fsync(dir); the only place the map is written
+static bool write_map_durable(const fs::path& path, const MapVals& m) {
+    const std::string data = format_map(m);
+    fs::path tmp = path;
+    tmp += ".tmp";
+
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t w = ::write(fd, data.data() + off, data.size() - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        off += (size_t)w;
+    }
+    bool ok = off == data.size() && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+
+    int dfd = ::open(path.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+        (void)::fsync(dfd);
+        ::close(dfd);
+    }
+    return true;
+}
+
+static void mark_map_dirty(MapStore& ms) {
+    if (ms.dirty) return;
+    ms.dirty = true;
+    ms.dirty_since_ms = mono_ms();
+}
+
+// Writes only if the interval passed (or force) and the values differ from the file
+static void flush_map(MapStore& ms, const MapVals& m, bool force) {
+    if (!ms.dirty) return;
+    const int64_t now = mono_ms();
+    if (!force && now - ms.dirty_since_ms < (int64_t)MAP_FLUSH_INTERVAL_S * 1000) return;
+
+    if (ms.on_disk && m == ms.flushed) {
+        ms.dirty = false; // learned back to what is stored
+        g_stats.map_flush_skipped++;
+        return;
+    }
+    if (write_map_durable(ms.path, m)) {
+        g_stats.map_flushes++;
+        ms.flushed = m;
+        ms.on_disk = true;
+        ms.dirty = false;
+    } else {
+        g_stats.map_flush_failed++;
+        std::fprintf(stderr, "batteryplus: Error: writing %s: %s\n", ms.path.c_str(), std::strerror(errno));
+        ms.dirty_since_ms = now; // retry one interval later
+    }
+}
+
+// Never writes; files without a CRC32 line (older versions) are accepted and converted on the next flush
+static MapVals load_map(MapStore& ms) {
+    const fs::path path = ms.path;
     MapVals m;
-    bool need_save = false;
     bool found_vfull = false;
     bool found_vempty = false;
     bool found_vdroop = false;
 
     std::ifstream f(path);
-    if (f) {
-        std::string line;
-        while (std::getline(f, line)) {
-            if (line.rfind("V_FULL=", 0) == 0) {
-                m.V_FULL = std::atoi(line.c_str() + 7);
-                found_vfull = true;
-            } else if (line.rfind("V_EMPTY=", 0) == 0) {
-                m.V_EMPTY = std::atoi(line.c_str() + 8);
-                found_vempty = true;
-            } else if (line.rfind("V_DROOP=", 0) == 0) {
-                m.V_DROOP = std::atoi(line.c_str() + 8);
-                found_vdroop = true;
-            }
-        }
-    } else {
+    if (!f) {
         // No file yet
         return m;
     }
-
-    // Ensure defaults if missing
-    if (!found_vfull) {
-        m.V_FULL = DEFAULT_V_FULL;
-        need_save = true;
-    }
-    if (!found_vempty) {
-        m.V_EMPTY = DEFAULT_V_EMPTY;
-        need_save = true;
+    std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+    size_t pos = 0;
+    bool checked = false;
+    if (data.rfind("CRC32=", 0) == 0) {
+        size_t nl = data.find('\n');
+        uint32_t want = (uint32_t)std::strtoul(data.c_str() + 6, nullptr, 16);
+        if (nl == std::string::npos || crc32(data.data() + nl + 1, data.size() - nl - 1) != want) {
+            std::fprintf(stderr, "batteryplus: Error: %s is torn or corrupt, using defaults\n", path.c_str());
+            return m;
+        }
+        pos = nl + 1;
+        checked = true;
     }
-    if (!found_vdroop) {
-        m.V_DROOP = DEFAULT_V_DROOP;
-        need_save = true;
+
+    while (pos < data.size()) {
+        size_t nl = data.find('\n', pos);
+        if (nl == std::string::npos) nl = data.size();
+        const std::string line = data.substr(pos, nl - pos);
+        pos = nl + 1;
+        if (line.rfind("V_FULL=", 0) == 0) {
+            m.V_FULL = std::atoi(line.c_str() + 7);
+            found_vfull = true;
+        } else if (line.rfind("V_EMPTY=", 0) == 0) {
+            m.V_EMPTY = std::atoi(line.c_str() + 8);
+            found_vempty = true;
+        } else if (line.rfind("V_DROOP=", 0) == 0) {
+            m.V_DROOP = std::atoi(line.c_str() + 8);
+            found_vdroop = true;
+        }
     }
 
+    // Ensure defaults if missing
+    if (!found_vfull) m.V_FULL = DEFAULT_V_FULL;
+    if (!found_vempty) m.V_EMPTY = DEFAULT_V_EMPTY;
+    if (!found_vdroop) m.V_DROOP = DEFAULT_V_DROOP;
+
     // Sanity V_EMPTY
     if (m.V_EMPTY < 3000 || m.V_EMPTY > 3400) {
         m.V_EMPTY = DEFAULT_V_EMPTY;
-        need_save = true;
     }
 
     // Sanity V_FULL
@@ -410,30 +835,29 @@ static MapVals load_map(const fs::path& path) {
         // Values are probably garbage so reset both main voltages
         m.V_FULL = DEFAULT_V_FULL;
         m.V_EMPTY = DEFAULT_V_EMPTY;
-        need_save = true;
     }
 
     // Sanity V_DROOP
     if (m.V_DROOP <= 1 || m.V_DROOP > 300) {
         m.V_DROOP = DEFAULT_V_DROOP;
-        need_save = true;
     }
 
-    if (need_save) {
-        save_map_atomic(path, m);
+    if (checked) {
+        ms.flushed = m;
+        ms.on_disk = true;
     }
-
     return m;
 }
 
-static void learn_vdroop(int last_charging_ema_mv, int discharge_ema_mv, MapVals& map, const char* map_file_path) {
-    if (last_charging_ema_mv <= 0 || discharge_ema_mv <= 0) return;
+// True if V_DROOP changed
+static bool learn_vdroop(int last_charging_ema_mv, int discharge_ema_mv, MapVals& map) {
+    if (last_charging_ema_mv <= 0 || discharge_ema_mv <= 0) return false;
 
     int sample_mv = last_charging_ema_mv - discharge_ema_mv;
 
     // Only learn from realistic positive droop
     if (sample_mv <= 1 || sample_mv >= 300) {
-        return;
+        return false;
     }
 
     int old_droop = (map.V_DROOP > 0 ? map.V_DROOP : DEFAULT_V_DROOP);
@@ -455,18 +879,20 @@ static void learn_vdroop(int last_charging_ema_mv, int discharge_ema_mv, MapVals
     int quantized = ((blended + 2) / 5) * 5; // round to nearest 5 mV
 
     if (std::abs(quantized - map.V_DROOP) < 3) {
-        return;
+        return false;
     }
 
     if (quantized != map.V_DROOP) {
         map.V_DROOP = quantized;
-        save_map_atomic(map_file_path, map);
+        return true;
     }
+    return false;
 }
 
-static void learn_vfull(int voltage_raw_mv, int voltage_ema_mv, MapVals& map) {
+// True if V_FULL changed
+static bool learn_vfull(int voltage_raw_mv, int voltage_ema_mv, MapVals& map) {
     if (voltage_raw_mv <= 0 || voltage_ema_mv <= 0) {
-        return;
+        return false;
     }
 
     int candidate = voltage_ema_mv;
@@ -475,7 +901,7 @@ static void learn_vfull(int voltage_raw_mv, int voltage_ema_mv, MapVals& map) {
     // Ignore tiny changes
     int diff = candidate - old_vfull;
     if (std::abs(diff) < 5) {
-        return;
+        return false;
     }
 
     // Don't let a single calibration change it too much
@@ -493,8 +919,9 @@ static void learn_vfull(int voltage_raw_mv, int voltage_ema_mv, MapVals& map) {
     // Only save if meaningfully changed
     if (std::abs(quantized - old_vfull) >= 5) {
         map.V_FULL = quantized;
-        save_map_atomic(MAP_FILE, map);
+        return true;
     }
+    return false;
 }
 
 // ========================= Percent calc =========================
@@ -504,8 +931,8 @@ struct SmoothedV {
     int ema = -1;
 };
 
-static int read_voltage_mv(const fs::path& voltage_now) {
-    auto vopt = slurp_int(voltage_now);
+static int read_voltage_mv(SysfsAttr& voltage_now) {
+    auto vopt = read_attr_int(voltage_now);
     if (!vopt) return -1;
     int raw = *vopt;
     // Unit autodetect: >= 100000 => microvolts
@@ -516,7 +943,7 @@ static int read_voltage_mv(const fs::path& voltage_now) {
 }
 
 // Dynamic droop compensation
-static int compute_dynamic_droop_mv(int approx_pct, const MapVals& m)
+static int droop_formula_mv(int approx_pct, const MapVals& m)
 {
     approx_pct = clampi(approx_pct, 0, 100);
 
@@ -548,11 +975,113 @@ static int compute_dynamic_droop_mv(int approx_pct, const MapVals& m)
     return droop;
 }
 
-static int voltage_to_percent(int voltage_now_mv, const MapVals& m) {
-    if (voltage_now_mv <= 0) {
-        // If we somehow get garbage voltage just return 1% so it's intentionally obvious
-        return 1;
+// ----- curve profiles -----
+// Shapes map a position in the 0-99% voltage window (V_EMPTY .. V_FULL minus droop and the 100%
+// window) to percent. Points are approximate resting OCV curves, scaled to the learned window.
+struct CurvePoint {
+    int pos; // 0-100 across the window
+    int pct;
+};
+
+struct CurveProfile {
+    std::string name;
+    double gamma = 1.20; // used when points is empty
+    std::vector<CurvePoint> points;
+};
+
+static const CurveProfile BUILTIN_CURVES[] = {
+    { "gamma", 1.20, {} },
+    { "li-ion", 0.0, { {0, 0}, {29, 5}, {44, 10}, {59, 22}, {66, 35}, {74, 48},
+                       {81, 58}, {88, 70}, {96, 85}, {100, 99} } },
+    { "lifepo4", 0.0, { {0, 0}, {15, 5}, {35, 10}, {50, 20}, {60, 40}, {70, 60},
+                        {80, 75}, {90, 88}, {100, 99} } },
+};
+
+static CurveProfile g_curve_profile = BUILTIN_CURVES[0];
+
+// Dense tables, one per supply, valid for built_for only
+struct CurveLut {
+    MapVals built_for;
+    bool valid = false;
+    int v_empty = 0;
+    int v_100_start = 0;
+    std::vector<uint8_t> pct; // [mV - v_empty], 0..99
+    std::array<int16_t, 101> droop{}; // [approx percent]
+};
+
+static bool valid_curve_points(const std::vector<CurvePoint>& pts) {
+    if (pts.size() < 2 || pts.front().pos != 0 || pts.back().pos != 100) return false;
+    for (size_t i = 0; i < pts.size(); ++i) {
+        if (pts[i].pct < 0 || pts[i].pct > 100) return false;
+        if (i > 0 && (pts[i].pos <= pts[i - 1].pos || pts[i].pct < pts[i - 1].pct)) return false;
+    }
+    return true;
+}
+
+static std::optional<CurveProfile> builtin_curve(const std::string& name) {
+    for (const auto& c : BUILTIN_CURVES) {
+        if (c.name == name) return c;
     }
+    return std::nullopt;
+}
+
+// CURVE_FILE holds a builtin name or "pos percent" lines ('#' comments), read once at startup,
+// before any table is built
+static void load_curve_profile(const fs::path& path) {
+    g_curve_profile = *builtin_curve(DEFAULT_CURVE);
+
+    std::ifstream f(path);
+    if (!f) return;
+
+    CurveProfile custom;
+    custom.name = path.string();
+    std::string line;
+    while (std::getline(f, line)) {
+        line = line.substr(0, line.find('#'));
+        size_t b = line.find_first_not_of(" \t\r");
+        if (b == std::string::npos) continue;
+        size_t e = line.find_last_not_of(" \t\r");
+        line = line.substr(b, e - b + 1);
+
+        CurvePoint pt;
+        if (std::sscanf(line.c_str(), "%d %d", &pt.pos, &pt.pct) == 2) {
+            custom.points.push_back(pt);
+        } else if (auto c = builtin_curve(line); c && custom.points.empty()) {
+            g_curve_profile = *c;
+            return;
+        } else {
+            custom.points.clear();
+            break;
+        }
+    }
+
+    if (valid_curve_points(custom.points)) {
+        g_curve_profile = custom;
+    } else {
+        std::fprintf(stderr, "batteryplus: Error: invalid curve in %s, using %s\n", path.c_str(), DEFAULT_CURVE);
+    }
+}
+
+static int curve_shape_pct(const CurveProfile& c, double x) {
+    double shaped;
+    if (c.points.empty()) {
+        shaped = std::pow(x, c.gamma) * 100.0;
+    } else {
+        const double pos = x * 100.0;
+        size_t i = 1;
+        while (i + 1 < c.points.size() && c.points[i].pos < pos) ++i;
+        const CurvePoint& lo = c.points[i - 1];
+        const CurvePoint& hi = c.points[i];
+        double t = (pos - lo.pos) / (double)(hi.pos - lo.pos);
+        shaped = lo.pct + std::clamp(t, 0.0, 1.0) * (hi.pct - lo.pct);
+    }
+    // apply the curve to only 0-99% (100% is excluded to keep an accurate top end)
+    return clampi(static_cast<int>(std::lround(shaped)), 0, 99);
+}
+
+static void build_curve(CurveLut& c, const MapVals& m) {
+    c.built_for = m;
+    c.valid = true;
 
     int v_empty = m.V_EMPTY;
     int v_full  = m.V_FULL;
@@ -577,29 +1106,41 @@ static int voltage_to_percent(int voltage_now_mv, const MapVals& m) {
         v_100_start = v_empty + 50;
     }
 
-    // Top 100%
-    if (voltage_now_mv >= v_100_start) {
-        return 100;
+    c.v_empty = v_empty;
+    c.v_100_start = v_100_start;
+    const int range_adj = v_100_start - v_empty;
+    c.pct.resize(range_adj + 1);
+    for (int i = 0; i <= range_adj; ++i) {
+        c.pct[i] = (uint8_t)curve_shape_pct(g_curve_profile, (double)i / (double)range_adj);
     }
 
-    // 0–99%
-    int v_clamped = clampi(voltage_now_mv, v_empty, v_100_start);
-    int range_adj = v_100_start - v_empty;
-    double x = 0.0;
-    if (range_adj > 0) {
-        x = static_cast<double>(v_clamped - v_empty) / static_cast<double>(range_adj);
+    for (int p = 0; p <= 100; ++p) {
+        c.droop[p] = (int16_t)droop_formula_mv(p, m);
     }
-    if (x < 0.0) x = 0.0;
-    if (x > 1.0) x = 1.0;
+}
+
+static inline const CurveLut& curve_for(CurveLut& c, const MapVals& m) {
+    if (!c.valid || !(c.built_for == m)) build_curve(c, m);
+    return c;
+}
+
+static int compute_dynamic_droop_mv(int approx_pct, const CurveLut& c) {
+    return c.droop[clampi(approx_pct, 0, 100)];
+}
 
-    constexpr double gamma = 1.20;
-    double shaped = std::pow(x, gamma);
+static int voltage_to_percent(int voltage_now_mv, const CurveLut& c) {
+    if (voltage_now_mv <= 0) {
+        // If we somehow get garbage voltage just return 1% so it's intentionally obvious
+        return 1;
+    }
 
-    int base_percent = static_cast<int>(std::lround(shaped * 100.0));
-    // apply gamma curve to only 0-99% (100% is excluded to keep an accurate top end)
-    base_percent = clampi(base_percent, 0, 99);
+    // Top 100%
+    if (voltage_now_mv >= c.v_100_start) {
+        return 100;
+    }
 
-    return base_percent;
+    // 0–99%
+    return c.pct[std::max(0, voltage_now_mv - c.v_empty)];
 }
 
 static int step_limit(int last, int target, bool charging) {
@@ -615,266 +1156,1392 @@ static int step_limit(int last, int target, bool charging) {
     }
 }
 
-// ========================= Signal handling =========================
-static void handle_signal(int) { g_running = false; }
+// ========================= History =========================
+// Fixed layout like ExportRecord. The writer stores the record, then publishes head (release).
+struct HistoryRecord {
+    int64_t t_ms; // CLOCK_MONOTONIC
+    int16_t raw_mv;
+    int16_t ema_mv;
+    uint8_t status; // ChargeStatus
+    uint8_t charging;
+    int8_t  internal_percent;
+    int8_t  visible_percent;
+};
+static_assert(sizeof(HistoryRecord) == 16);
+
+struct HistoryHeader {
+    uint32_t magic; // HISTORY_MAGIC
+    uint16_t version;
+    uint16_t record_size; // sizeof(HistoryRecord)
+    uint32_t capacity;
+    uint32_t head; // records ever written, wraps
+};
+static constexpr uint32_t HISTORY_MAGIC = 0x53485042; // "BPHS"
+
+static constexpr int ESTIMATE_TAU_S = 30 * 60; // weight of a sample halves every ~21 min
+static constexpr int ESTIMATE_MIN_SPAN_S = 5 * 60; // no estimate before this much data
+static constexpr int ESTIMATE_MAX_MIN = 48 * 60; // longer is reported as unknown
+static constexpr double ESTIMATE_MIN_PCT_H = 0.1; // flatter than this is "not moving"
+
+// Weighted least squares of y over x = hours relative to the newest sample. Moving x along
+// and decaying the sums is O(1) per sample; nothing is ever rescanned.
+struct Estimator {
+    bool active = false;
+    bool charging = false;
+    int64_t first_ms = 0;
+    int64_t last_ms = 0;
+    double s0 = 0, sx = 0, sxx = 0;
+    double smv = 0, sxmv = 0; // EMA mV
+    double spct = 0, sxpct = 0; // internal percent
+};
 
-// ========================= Main =========================
-int main() {
-    // Signals
-    std::signal(SIGINT, handle_signal);
-    std::signal(SIGTERM, handle_signal);
-    std::signal(SIGUSR1, handle_reset);
+struct Estimate {
+    int mv_per_hour = 0;
+    int tte_min = -1; // -1 unknown / not discharging
+    int ttf_min = -1; // -1 unknown / not charging
+};
 
-    // Ensure directories exist
-    fs::create_directories(fs::path(ROOT));
-    fs::create_directories(fs::path(ROOT) / "charging.d");
-    fs::create_directories(fs::path(ROOT) / "discharging.d");
+struct History {
+    HistoryHeader* hdr = nullptr; // nullptr if shm is unavailable
+    HistoryRecord* recs = nullptr;
+    Estimator est;
+};
+static constexpr size_t HISTORY_BYTES = sizeof(HistoryHeader) + sizeof(HistoryRecord) * HISTORY_CAPACITY;
+
+static void estimator_add(Estimator& e, int64_t t_ms, int ema_mv, int pct, bool charging) {
+    if (ema_mv <= 0 || pct < 0) return;
+    if (!e.active || e.charging != charging || t_ms < e.last_ms) {
+        e = Estimator{};
+        e.active = true;
+        e.charging = charging;
+        e.first_ms = e.last_ms = t_ms;
+    } else {
+        // older points move to negative x, then fade
+        const double dt = (t_ms - e.last_ms) / 3600000.0;
+        e.sxx += dt * (dt * e.s0 - 2.0 * e.sx);
+        e.sx -= dt * e.s0;
+        e.sxmv -= dt * e.smv;
+        e.sxpct -= dt * e.spct;
+
+        const double k = std::exp(-(double)(t_ms - e.last_ms) / (ESTIMATE_TAU_S * 1000.0));
+        e.s0 *= k; e.sx *= k; e.sxx *= k;
+        e.smv *= k; e.sxmv *= k;
+        e.spct *= k; e.sxpct *= k;
+        e.last_ms = t_ms;
+    }
+    e.s0 += 1.0;
+    e.smv += ema_mv;
+    e.spct += pct;
+}
 
-    HookCache hooks;
-    load_hook_cache(hooks);
+static Estimate estimate(const Estimator& e) {
+    Estimate out;
+    const double den = e.s0 * e.sxx - e.sx * e.sx;
+    if (!e.active || e.last_ms - e.first_ms < ESTIMATE_MIN_SPAN_S * 1000 || den <= 1e-12) return out;
+
+    out.mv_per_hour = (int)std::lround((e.s0 * e.sxmv - e.sx * e.smv) / den);
+    const double pct_h = (e.s0 * e.sxpct - e.sx * e.spct) / den;
+    const double pct_now = std::clamp((e.spct - pct_h * e.sx) / e.s0, 0.0, 100.0); // fit at x = 0
+
+    double minutes = -1.0;
+    if (!e.charging && pct_h < -ESTIMATE_MIN_PCT_H) minutes = pct_now / -pct_h * 60.0;
+    if (e.charging && pct_h > ESTIMATE_MIN_PCT_H) minutes = (100.0 - pct_now) / pct_h * 60.0;
+    if (minutes > ESTIMATE_MAX_MIN) minutes = -1.0;
+    if (minutes >= 0.0) (e.charging ? out.ttf_min : out.tte_min) = (int)std::lround(minutes);
+    return out;
+}
 
-    // Find battery
-    auto bp_opt = find_battery();
-    if (!bp_opt) {
-        std::fprintf(stderr, "batteryplus: Error: No battery detected!\n");
-        return 1;
+// Replays the newest run of same-charging records (at most a few time constants) into the estimator
+static void seed_estimator(History& hist, int64_t now) {
+    const HistoryHeader* h = hist.hdr;
+    const uint32_t n = std::min(h->head, h->capacity);
+    if (n == 0) return;
+    const HistoryRecord& newest = hist.recs[(h->head - 1) % h->capacity];
+    if (newest.t_ms > now || now - newest.t_ms > (int64_t)ESTIMATE_MIN_SPAN_S * 1000) return; // stale
+
+    uint32_t k = 0;
+    while (k + 1 < n) {
+        const HistoryRecord& r = hist.recs[(h->head - 2 - k) % h->capacity];
+        if (r.charging != newest.charging || r.t_ms > newest.t_ms ||
+            newest.t_ms - r.t_ms > (int64_t)ESTIMATE_TAU_S * 3000) break;
+        ++k;
     }
-    BatteryPaths bp = *bp_opt;
+    for (uint32_t i = 0; i <= k; ++i) {
+        const HistoryRecord& r = hist.recs[(h->head - 1 - k + i) % h->capacity];
+        estimator_add(hist.est, r.t_ms, r.ema_mv, r.internal_percent, r.charging);
+    }
+}
 
-    // Voltage map
-    MapVals map = load_map(MAP_FILE);
+static void open_history(History& hist, const std::string& shm_name) {
+    const size_t len = HISTORY_BYTES;
+    int fd = ::shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    ::fchmod(fd, 0644); // umask
+    struct stat sb{};
+    void* p = MAP_FAILED;
+    if (::fstat(fd, &sb) == 0 && (sb.st_size == (off_t)len || ::ftruncate(fd, len) == 0)) {
+        p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd); // the mapping stays
+    if (p == MAP_FAILED) return;
+
+    hist.hdr = static_cast<HistoryHeader*>(p);
+    hist.recs = reinterpret_cast<HistoryRecord*>(hist.hdr + 1);
+    HistoryHeader* h = hist.hdr;
+    if (h->magic != HISTORY_MAGIC || h->version != 1 || h->record_size != sizeof(HistoryRecord) ||
+        h->capacity != HISTORY_CAPACITY) {
+        std::memset(p, 0, len);
+        h->version = 1;
+        h->record_size = sizeof(HistoryRecord);
+        h->capacity = HISTORY_CAPACITY;
+        std::atomic_ref<uint32_t>(h->magic).store(HISTORY_MAGIC, std::memory_order_release);
+    } else {
+        seed_estimator(hist, mono_ms());
+    }
+}
 
-    if (!fs::exists(MAP_FILE)) {
-        fs::create_directories(fs::path(MAP_FILE).parent_path());
-        save_map_atomic(MAP_FILE, map);
+// The ring stays in shm, a supply that comes back picks up where it left
+static void close_history(History& hist) {
+    if (hist.hdr) ::munmap(hist.hdr, HISTORY_BYTES);
+    hist = History{};
+}
+
+// No allocation: one store into the ring and an O(1) estimator update per sample
+static Estimate history_sample(History& hist, int raw_mv, int ema_mv, ChargeStatus status, bool charging,
+                               int internal_percent, int visible_percent, bool restart) {
+    const int64_t now = mono_ms();
+    if (HistoryHeader* h = hist.hdr) {
+        std::atomic_ref<uint32_t> head(h->head);
+        const uint32_t i = head.load(std::memory_order_relaxed);
+        HistoryRecord& r = hist.recs[i % h->capacity];
+        r.t_ms = now;
+        r.raw_mv = (int16_t)clampi(raw_mv, -1, INT16_MAX);
+        r.ema_mv = (int16_t)clampi(ema_mv, -1, INT16_MAX);
+        r.status = (uint8_t)status;
+        r.charging = charging;
+        r.internal_percent = (int8_t)internal_percent;
+        r.visible_percent = (int8_t)visible_percent;
+        head.store(i + 1, std::memory_order_release);
     }
+    if (restart) hist.est.active = false;
+    estimator_add(hist.est, now, ema_mv, internal_percent, charging);
+    return estimate(hist.est);
+}
+
+// ========================= Export =========================
+// Fixed layout, shared with readers: grow only by appending fields and bumping version
+struct ExportRecord {
+    uint32_t magic; // EXPORT_MAGIC
+    uint16_t version;
+    uint16_t size; // sizeof(ExportRecord)
+    uint32_t seq; // odd while the writer is inside, +2 per update
+    int32_t  percent; // visible
+    int32_t  internal_percent;
+    int32_t  ema_mv;
+    int32_t  raw_mv;
+    uint8_t  charging;
+    uint8_t  status; // ChargeStatus
+    uint8_t  pad[2];
+    int64_t  updated_ms; // CLOCK_MONOTONIC
+    // version 2
+    int32_t  mv_per_hour; // EMA trend, negative while discharging
+    int32_t  tte_min; // time to empty, -1 unknown
+    int32_t  ttf_min; // time to full, -1 unknown
+    uint8_t  pad2[4];
+};
+static constexpr uint32_t EXPORT_MAGIC = 0x534c5042; // "BPLS"
+
+// One per supply; the socket is shared and lines carry supply=NAME
+struct ExportChannel {
+    bool used = false;
+    std::string supply; // power_supply name
+    std::string shm; // shm_open() name, unlinked when the supply goes away
+    ExportRecord* rec = nullptr; // nullptr if shm is unavailable
+    int last_percent = -1; // as last notified
+    int last_charging = -1;
+    Estimate est; // as last exported
+};
+
+struct Exporter {
+    int sfd = -1; // notification socket listener
+    int clients[EXPORT_MAX_CLIENTS];
+    int nclients = 0;
+    std::array<ExportChannel, MAX_SUPPLIES> ch;
+};
+static Exporter g_export;
+
+static void open_export(int epfd) {
+    if (EXPORT_PERCENT_FILE) fs::create_directories(fs::path(PERCENT_FILE).parent_path());
+
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    std::snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", EXPORT_SOCKET);
+    ::unlink(EXPORT_SOCKET);
+    int sfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd < 0) return;
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = ep_tag(sfd);
+    if (::bind(sfd, (sockaddr*)&sa, sizeof(sa)) < 0 || ::listen(sfd, 8) < 0 ||
+        ::epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+        ::close(sfd);
+        return;
+    }
+    ::chmod(EXPORT_SOCKET, 0666);
+    g_export.sfd = sfd;
+}
+
+// Slot index for a new supply, -1 if all MAX_SUPPLIES are taken
+static int open_export_channel(const std::string& supply, const std::string& shm) {
+    int slot = 0;
+    while (slot < MAX_SUPPLIES && g_export.ch[slot].used) ++slot;
+    if (slot == MAX_SUPPLIES) return -1;
+    ExportChannel& c = g_export.ch[slot];
+    c = ExportChannel{};
+    c.used = true;
+    c.supply = supply;
+    c.shm = shm;
+
+    int fd = ::shm_open(shm.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        ::fchmod(fd, 0644); // umask
+        if (::ftruncate(fd, sizeof(ExportRecord)) == 0) {
+            void* p = ::mmap(nullptr, sizeof(ExportRecord), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                c.rec = static_cast<ExportRecord*>(p);
+                std::memset(c.rec, 0, sizeof(ExportRecord));
+                c.rec->version = 2;
+                c.rec->size = sizeof(ExportRecord);
+                std::atomic_ref<uint32_t>(c.rec->magic).store(EXPORT_MAGIC, std::memory_order_release);
+            }
+        }
+        ::close(fd); // the mapping stays
+    }
+    return slot;
+}
 
-    // State
+static void close_export_channel(int slot) {
+    if (slot < 0) return;
+    ExportChannel& c = g_export.ch[slot];
+    if (c.rec) {
+        ::munmap(c.rec, sizeof(ExportRecord));
+        ::shm_unlink(c.shm.c_str()); // readers must not see a stale record
+    }
+    c = ExportChannel{};
+}
+
+static int format_export(const ExportChannel& c, char* buf, size_t n) {
+    const ExportRecord* r = c.rec;
+    return std::snprintf(buf, n, "percent=%d internal=%d ema_mv=%d charging=%d seq=%u mv_h=%d tte_min=%d ttf_min=%d supply=%s\n",
+                         c.last_percent, r ? r->internal_percent : -1, r ? r->ema_mv : -1,
+                         c.last_charging, r ? r->seq : 0u,
+                         c.est.mv_per_hour, c.est.tte_min, c.est.ttf_min, c.supply.c_str());
+}
+
+static void drop_export_client(int i) {
+    ::close(g_export.clients[i]);
+    g_export.clients[i] = g_export.clients[--g_export.nclients];
+}
+
+static void notify_clients(const ExportChannel& c) {
+    char line[192];
+    int len = std::min(format_export(c, line, sizeof(line)), (int)sizeof(line) - 1);
+    for (int i = 0; i < g_export.nclients; ) {
+        // a client that can't keep up with a few bytes per percent is gone
+        if (::send(g_export.clients[i], line, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) drop_export_client(i);
+        else ++i;
+    }
+}
+
+// New clients get the current values of every supply right away
+static void accept_export_clients(int epfd) {
+    int fd;
+    while ((fd = ::accept4(g_export.sfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = ep_tag(fd);
+        if (g_export.nclients >= EXPORT_MAX_CLIENTS || ::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            ::close(fd);
+            continue;
+        }
+        g_export.clients[g_export.nclients++] = fd;
+        for (const ExportChannel& c : g_export.ch) {
+            if (!c.used || c.last_percent < 0) continue;
+            char line[192];
+            int len = std::min(format_export(c, line, sizeof(line)), (int)sizeof(line) - 1);
+            (void)::send(fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+    }
+}
+
+static void dump_stats(int fd);
+
+// Clients mostly listen: "stats" gets a dump_stats() reply, anything else is discarded,
+// EOF or error closes them
+static bool handle_export_client(int fd) {
+    for (int i = 0; i < g_export.nclients; ++i) {
+        if (g_export.clients[i] != fd) continue;
+        char buf[64];
+        ssize_t n;
+        while ((n = ::recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            if (::memmem(buf, n, "stats", 5)) dump_stats(fd);
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) drop_export_client(i);
+        return true;
+    }
+    return false;
+}
+
+// Every sample refreshes the record; clients hear about visible percent and charging changes only
+static void export_sample(int slot, int percent, int internal_percent, int ema_mv, int raw_mv, bool charging,
+                          ChargeStatus status, const Estimate& est) {
+    if (slot < 0) return;
+    ExportChannel& c = g_export.ch[slot];
+    c.est = est;
+    if (ExportRecord* r = c.rec) {
+        std::atomic_ref<uint32_t> seq(r->seq);
+        const uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        r->percent = percent;
+        r->internal_percent = internal_percent;
+        r->ema_mv = ema_mv;
+        r->raw_mv = raw_mv;
+        r->charging = charging;
+        r->status = (uint8_t)status;
+        r->updated_ms = mono_ms();
+        r->mv_per_hour = est.mv_per_hour;
+        r->tte_min = est.tte_min;
+        r->ttf_min = est.ttf_min;
+        seq.store(s + 2, std::memory_order_release);
+    }
+    if (percent != c.last_percent || (int)charging != c.last_charging) {
+        c.last_percent = percent;
+        c.last_charging = charging;
+        notify_clients(c);
+    }
+}
+
+// ========================= Sampling =========================
+// Everything per supply; the primary one also drives PERCENT_FILE and the hooks
+struct Monitor {
+    BatteryPaths bp;
+    bool primary = false;
+    MapVals map;
+    MapStore store;
+    CurveLut curve;
+    History history;
+    int export_slot = -1;
     SmoothedV sv;
     int internal_percent = -1; // smoothed percent from voltage
     int visible_percent = -1; // step-limited percent we expose
     int last_bucket = -1;
     int last_charging_ema_mv = -1;
     bool vfull_recorded = false;
+    ChargeStatus last_status = ChargeStatus::Unknown; // as of the last sample
+
+    // Sample scheduling
+    int next_interval_s = INTERNAL_INTERVAL_S;
+    int settle = SETTLE_SAMPLES; // samples left at the base interval
+    int slope_prev_ema = -1;
+    int64_t slope_prev_ms = 0;
+    double slope_mv_per_min = 0.0; // smoothed dV/dt of the EMA, negative while discharging
 
     // Droop learning: require 3 stable ticks on each side
     int charging_streak = 0;
     int discharging_streak = 0;
     bool droop_armed = false;
 
-    auto last_visible_write = std::chrono::steady_clock::now();
-
-    while (g_running) {
-        // Read status and voltage
-        int voltage_raw_mv = read_voltage_mv(bp.voltage_now);
-        std::string status_str = read_charge_status(bp.status);
-
-        bool charging = false;
-        bool status_full = false;
-        bool first_visible = (visible_percent < 0);
-        bool reset = g_reset.exchange(false);
-        bool hooks_fired = false;
-
-        if (!status_str.empty()) {
-            if (status_str.rfind("Charging", 0) == 0) {
-                charging = true;
-            } else if (status_str.rfind("Full", 0) == 0) {
-                charging = true;
-                status_full = true;
-            }
-        }
+    int64_t last_visible_write_ms = 0; // mono_ms() or the simulator's clock
+    bool snap_pending = false; // back to ACTIVE: next sample may snap like a reset, without the hooks
+};
 
-        // Track charging/discharging streaks, and arm droop learning after 3 charging ticks
-        if (charging) {
-            charging_streak++;
-            discharging_streak = 0;
+// What one pipeline step decided; sample_tick() carries it out, the simulator only counts it
+struct StepResult {
+    int raw_mv = -1;
+    int ema_mv = -1;
+    ChargeStatus status = ChargeStatus::Unknown;
+    bool charging = false;
+    bool wipe_ema = false;
+    bool visible_changed = false; // write PERCENT_FILE
+    bool visible_deferred = false; // internal differs, not written yet
+    int hook_bucket = -1; // run this bucket's hooks
+    bool run_any_hooks = false; // reset without a bucket change: wildcard hooks
+    bool map_changed = false; // learned V_FULL / V_DROOP moved
+};
 
-            if (charging_streak >= 3) {
-                droop_armed = true;
-            }
-        } else {
-            discharging_streak++;
-            charging_streak = 0;
-        }
+// dV/dt of the EMA in mV/min, smoothed over samples; restarted on charge changes and EMA wipes
+static void update_slope(Monitor& st, bool restart, int64_t now) {
+    if (restart || st.slope_prev_ema < 0 || st.sv.ema < 0) {
+        st.slope_mv_per_min = 0.0;
+    } else if (now > st.slope_prev_ms) {
+        double inst = (st.sv.ema - st.slope_prev_ema) * 60000.0 / (double)(now - st.slope_prev_ms);
+        st.slope_mv_per_min = 0.7 * st.slope_mv_per_min + 0.3 * inst;
+    }
+    st.slope_prev_ema = st.sv.ema;
+    st.slope_prev_ms = now;
+}
+
+// Sample about four times before the voltage can reach the next 5% bucket below, within
+// [SAMPLE_MIN_S, SAMPLE_MAX_S]. Charging, settling, catching up the visible percent and the
+// low range keep the old INTERNAL_INTERVAL_S cadence (or faster). While IdleWatcher reports IDLE
+// or EXTENDED nobody is looking, so discharge is sampled every IDLE_SAMPLE_S / EXTENDED_SAMPLE_S
+// (SAMPLE_MAX_S in the low range).
+enum class IdleLevel : uint8_t { Active, Idle, Extended };
+static IdleLevel g_idle = IdleLevel::Active; // IdleWatcher's state, Active while it is unknown
+
+static int plan_interval_s(const Monitor& st, bool charging) {
+    if (charging || st.settle > 0 || st.internal_percent < 0) return INTERNAL_INTERVAL_S;
+    if (g_idle != IdleLevel::Active) { // visible catches up or snaps back on ACTIVE
+        if (st.internal_percent <= LOW_PCT_THRESHOLD) return SAMPLE_MAX_S;
+        return g_idle == IdleLevel::Extended ? EXTENDED_SAMPLE_S : IDLE_SAMPLE_S;
+    }
+    if (st.visible_percent != st.internal_percent) return INTERNAL_INTERVAL_S; // step_limit() pacing
 
-        // Median-of-3 then EMA for live voltage (for calculations only)
-        if (sv.prev1 < 0)
-            sv.prev1 = (voltage_raw_mv > 0 ? voltage_raw_mv : map.V_FULL);
-        if (sv.prev2 < 0)
-            sv.prev2 = sv.prev1;
+    int dist_pct = st.internal_percent - bucket5(st.internal_percent);
+    if (dist_pct == 0) dist_pct = 5; // on a bucket, its hooks already ran
+    const double mv_per_pct = std::max(1.0, (st.map.V_FULL - st.map.V_EMPTY) / 100.0);
 
-        int v_med = median3(
-            sv.prev2,
-            sv.prev1,
-            (voltage_raw_mv > 0 ? voltage_raw_mv : sv.prev1)
-        );
+    int interval = SAMPLE_MAX_S;
+    const double falling = -st.slope_mv_per_min; // mV/min
+    if (falling > 0.01) {
+        double eta_s = dist_pct * mv_per_pct / falling * 60.0;
+        interval = (int)std::clamp(eta_s / 4.0, (double)SAMPLE_MIN_S, (double)SAMPLE_MAX_S);
+    }
+    if (st.internal_percent <= LOW_PCT_THRESHOLD) interval = std::min(interval, INTERNAL_INTERVAL_S);
+    return interval;
+}
 
-        sv.prev2 = sv.prev1;
-        sv.prev1 = (voltage_raw_mv > 0 ? voltage_raw_mv : sv.prev1);
+// Voltage the percent is computed from: while charging, minus the learned droop at roughly the
+// current percent
+static int droop_adjusted_mv(const Monitor& st, const CurveLut& curve, int mv, bool charging) {
+    if (!charging) return mv;
 
-        if (sv.ema < 0)
-            sv.ema = v_med;
-        else
-            sv.ema = (ALPHA_NUM * v_med + (ALPHA_DEN - ALPHA_NUM) * sv.ema) / ALPHA_DEN;
+    // Use stable visible percent if available
+    // Otherwise use a draft percent directly from the voltage.
+    int approx_pct = (st.visible_percent >= 0)
+        ? st.visible_percent
+        : voltage_to_percent(mv, curve);
 
-        int voltage_ema_mv = sv.ema;
+    int droop_mv = compute_dynamic_droop_mv(approx_pct, curve);
+    if (droop_mv <= 0) return mv;
 
-        // Voltage droop compensation while charging
-        int voltage_for_percent_mv = voltage_ema_mv;
+    int adjusted = mv - droop_mv;
 
-        if (charging) {
-            // Use stable visible percent if available
-            // Otherwise use a draft percent directly from the ema voltage.
-            int approx_pct = (visible_percent >= 0)
-                ? visible_percent
-                : voltage_to_percent(voltage_ema_mv, map);
+    if (adjusted < st.map.V_EMPTY)
+        adjusted = st.map.V_EMPTY;
+    if (adjusted > st.map.V_FULL)
+        adjusted = st.map.V_FULL;
 
-            int droop_mv = compute_dynamic_droop_mv(approx_pct, map);
+    return adjusted;
+}
 
-            if (droop_mv > 0) {
-                int adjusted = voltage_ema_mv - droop_mv;
+// Smooth, learn, pick the visible percent and the next interval: median3 -> EMA -> droop ->
+// voltage_to_percent() -> step_limit(). No I/O, the clock is passed in. reset = SIGUSR1 or resume
+static StepResult pipeline_step(Monitor& st, int voltage_raw_mv, ChargeStatus status, bool reset, int64_t now_ms) {
+    StepResult res;
+    const CurveLut& curve = curve_for(st.curve, st.map);
+    const bool snap = reset || st.snap_pending; // a fresh look at the voltage is due
+    st.snap_pending = false;
+    if (status != st.last_status) st.settle = SETTLE_SAMPLES;
+    st.last_status = status;
+
+    bool charging = false;
+    bool status_full = false;
+    bool first_visible = (st.visible_percent < 0);
+    bool hooks_fired = false;
+
+    if (status == ChargeStatus::Charging) {
+        charging = true;
+    } else if (status == ChargeStatus::Full) {
+        charging = true;
+        status_full = true;
+    }
 
-                if (adjusted < map.V_EMPTY)
-                    adjusted = map.V_EMPTY;
-                if (adjusted > map.V_FULL)
-                    adjusted = map.V_FULL;
+    // Track charging/discharging streaks, and arm droop learning after 3 charging ticks
+    if (charging) {
+        st.charging_streak++;
+        st.discharging_streak = 0;
 
-                voltage_for_percent_mv = adjusted;
-            }
+        if (st.charging_streak >= 3) {
+            st.droop_armed = true;
         }
+    } else {
+        st.discharging_streak++;
+        st.charging_streak = 0;
+    }
+
+    // On reset judge the fresh reading: median-of-3 and the EMA still hold the voltage from before
+    // the suspend and would hide the jump we want to snap to
+    bool wipe_ema = false;
+    if (snap && voltage_raw_mv > 0) {
+        const int fresh_pct = voltage_to_percent(droop_adjusted_mv(st, curve, voltage_raw_mv, charging), curve);
+        if (first_visible || std::abs(fresh_pct - st.visible_percent) >= 3) {
+            wipe_ema = true;
+        }
+    }
+
+    // If needed reset ema history
+    if (wipe_ema) {
+        st.sv.prev1 = st.sv.prev2 = voltage_raw_mv;
+        st.sv.ema = voltage_raw_mv;
+    }
+
+    // Median-of-3 then EMA for live voltage (for calculations only)
+    if (st.sv.prev1 < 0)
+        st.sv.prev1 = (voltage_raw_mv > 0 ? voltage_raw_mv : st.map.V_FULL);
+    if (st.sv.prev2 < 0)
+        st.sv.prev2 = st.sv.prev1;
+
+    int v_med = median3(
+        st.sv.prev2,
+        st.sv.prev1,
+        (voltage_raw_mv > 0 ? voltage_raw_mv : st.sv.prev1)
+    );
+
+    st.sv.prev2 = st.sv.prev1;
+    st.sv.prev1 = (voltage_raw_mv > 0 ? voltage_raw_mv : st.sv.prev1);
+
+    if (st.sv.ema < 0)
+        st.sv.ema = v_med;
+    else
+        st.sv.ema = (ALPHA_NUM * v_med + (ALPHA_DEN - ALPHA_NUM) * st.sv.ema) / ALPHA_DEN;
+
+    int voltage_ema_mv = st.sv.ema;
+
+    // Voltage droop compensation while charging
+    int voltage_for_percent_mv = droop_adjusted_mv(st, curve, voltage_ema_mv, charging);
 
-        // Calculate target percent
-        int target = voltage_to_percent(voltage_for_percent_mv, map);
+    // Calculate target percent
+    int target = voltage_to_percent(voltage_for_percent_mv, curve);
 
-        internal_percent = target;
+    st.internal_percent = target;
 
-        bool timeout_full = charging && internal_percent >= 99 && charging_streak >= CHARGE_FULL_FALLBACK_TICKS;
+    bool timeout_full = charging && st.internal_percent >= 99 && st.charging_streak >= CHARGE_FULL_FALLBACK_TICKS;
 
-        // Set to 100% once pmic reports
-        if (charging) {
-            if (status_full || timeout_full) {
-                internal_percent = 100;
-            } else if (internal_percent > 99) {
-                internal_percent = 99;
+    // Set to 100% once pmic reports
+    if (charging) {
+        if (status_full || timeout_full) {
+            st.internal_percent = 100;
+        } else if (st.internal_percent > 99) {
+            st.internal_percent = 99;
+        }
+    }
+
+    // Compute delta
+    int delta_pct = 0;
+    if (!first_visible && st.visible_percent >= 0) {
+        delta_pct = std::abs(st.internal_percent - st.visible_percent);
+    }
+
+    // Update V_FULL once when status is "Full"
+    if (!st.vfull_recorded) {
+        if ((status_full || timeout_full) && voltage_raw_mv > 0) {
+            if (learn_vfull(voltage_raw_mv, voltage_ema_mv, st.map)) res.map_changed = true;
+            st.vfull_recorded = true;
             }
         }
 
-        // Compute delta
-        int delta_pct = 0;
-        if (!first_visible && visible_percent >= 0) {
-            delta_pct = std::abs(internal_percent - visible_percent);
+    // Decide if we need to write the file / run hooks
+    bool need_visible_update = false;
+
+    if (first_visible) {
+        // Initial loop
+        need_visible_update = true;
+
+    } else if (st.internal_percent != st.visible_percent) {
+        const int64_t elapsed_s = (now_ms - st.last_visible_write_ms) / 1000;
+
+        // Choose interval based on low or normal range or when charging
+        int required_interval = WRITE_INTERVAL;
+        if (st.internal_percent <= LOW_PCT_THRESHOLD || charging) {
+            required_interval = WRITE_INTERVAL / 2; // lets just halve normal interval
         }
 
-        // On reset decide if we should wipe smoothing
-        bool wipe_ema = false;
-        if (reset) {
-            if (first_visible || delta_pct >= 3) {
-                wipe_ema = true;
-            }
+        if (snap && delta_pct >= 3) {
+            // reset + meaningful change: force write now
+            need_visible_update = true;
+        } else if (elapsed_s >= required_interval) {
+            need_visible_update = true;
         }
+    }
 
-        // If needed reset ema history
-        if (wipe_ema) {
-            if (voltage_raw_mv > 0) {
-                sv.prev1 = sv.prev2 = voltage_raw_mv;
-                sv.ema = voltage_raw_mv;
-            } else {
-                sv.prev1 = sv.prev2 = sv.ema = -1;
-            }
+    res.visible_deferred = !need_visible_update && st.internal_percent != st.visible_percent;
+    if (need_visible_update) {
+        int new_visible = st.visible_percent;
+
+        if (first_visible) {
+            // Initial loop
+            new_visible = st.internal_percent;
+        } else if (snap && delta_pct >= 3) {
+            // reset + meaningful change: snap visible to internal
+            new_visible = st.internal_percent;
+        } else {
+            new_visible = step_limit(st.visible_percent, st.internal_percent, charging);
         }
 
-        // Update V_FULL once when status is "Full"
-        if (!vfull_recorded) {
-            if ((status_full || timeout_full) && voltage_raw_mv > 0) {
-                learn_vfull(voltage_raw_mv, voltage_ema_mv, map);
-                vfull_recorded = true;
+        if (new_visible != st.visible_percent) {
+            st.visible_percent = new_visible;
+            res.visible_changed = true;
+            st.last_visible_write_ms = now_ms;
+
+            // fire once and on exact 5% increments
+            if (st.primary && st.visible_percent % 5 == 0) {
+                int b = st.visible_percent;
+                if (b != st.last_bucket) {
+                    res.hook_bucket = b;
+                    st.last_bucket = b;
+                    hooks_fired = true; // we fired off hooks this loop
                 }
             }
+        }
+    }
 
-        // Decide if we need to write the file / run hooks
-        bool need_visible_update = false;
-        auto now = std::chrono::steady_clock::now();
+    // Run wildcard scripts once on reset only if we didn't already
+    if (reset && st.primary) {
+        if (!hooks_fired) res.run_any_hooks = true;
+    }
 
-        if (first_visible) {
-            // Initial loop
-            need_visible_update = true;
+    // Learn droop once when armed
+    if (st.droop_armed && !charging && st.discharging_streak >= 3) {
+        if (st.last_charging_ema_mv > 0 && v_med > 0) {
+            if (learn_vdroop(st.last_charging_ema_mv, v_med, st.map)) res.map_changed = true;
+        }
+        // Reset arming
+        st.droop_armed = false;
+    }
 
-        } else if (internal_percent != visible_percent) {
-            auto elapsed_s = std::chrono::duration_cast<std::chrono::seconds>(now - last_visible_write).count();
+    // Remember last charging voltage for next loop
+    if (charging) {
+        st.last_charging_ema_mv = voltage_ema_mv;
+    }
 
-            // Choose interval based on low or normal range or when charging
-            int required_interval = WRITE_INTERVAL;
-            if (internal_percent <= LOW_PCT_THRESHOLD || charging) {
-                required_interval = WRITE_INTERVAL / 2; // lets just halve normal interval
-            }
+    if (snap) st.settle = SETTLE_SAMPLES;
+    update_slope(st, charging || wipe_ema, now_ms);
+    st.next_interval_s = plan_interval_s(st, charging);
+    if (st.settle > 0) st.settle--;
+
+    res.raw_mv = voltage_raw_mv;
+    res.ema_mv = voltage_ema_mv;
+    res.status = status;
+    res.charging = charging;
+    res.wipe_ema = wipe_ema;
+    return res;
+}
+
+// One sample: read, run the pipeline, publish, run hooks, maybe flush the map
+static void sample_tick(Monitor& st, HookCache& hooks, bool reset) {
+    // Read status and voltage
+    const int64_t t0 = mono_us();
+    int voltage_raw_mv = read_voltage_mv(st.bp.voltage_now);
+    ChargeStatus status = read_charge_status(st.bp.status);
+    const int64_t t1 = mono_us();
+
+    const StepResult r = pipeline_step(st, voltage_raw_mv, status, reset, t1 / 1000);
+
+    hist_add(g_stats.sysfs_us, t1 - t0);
+    hist_add(g_stats.step_us, mono_us() - t1);
+    g_stats.samples++;
+    if (voltage_raw_mv <= 0) g_stats.invalid_reads++;
+    if (r.wipe_ema) g_stats.ema_wipes++;
+    if (r.visible_changed) g_stats.visible_written++;
+    if (r.visible_deferred) g_stats.visible_deferred++;
+
+    if (r.visible_changed && EXPORT_PERCENT_FILE && st.primary)
+        (void)write_atomic(PERCENT_FILE, std::to_string(st.visible_percent) + "\n", 0644);
+    if (r.hook_bucket >= 0) run_bucket_hooks_cached(hooks, r.charging, r.hook_bucket);
+    if (r.run_any_hooks) queue_hooks(r.charging, r.charging ? hooks.charging_any : hooks.discharging_any);
+    if (r.map_changed) mark_map_dirty(st.store);
+
+    const Estimate est = history_sample(st.history, r.raw_mv, r.ema_mv, r.status, r.charging,
+                                        st.internal_percent, st.visible_percent, reset || r.wipe_ema);
+    export_sample(st.export_slot, st.visible_percent, st.internal_percent, r.ema_mv, r.raw_mv, r.charging,
+                  r.status, est);
+
+    flush_map(st.store, st.map, false);
+}
+
+// One batched tick over all supplies; returns the interval the soonest of them asks for
+static int sample_all(std::vector<Monitor>& mons, HookCache& hooks, bool reset) {
+    int next = EXTENDED_SAMPLE_S; // longest plan_interval_s(), so the idle back-off isn't clamped
+    for (Monitor& st : mons) {
+        sample_tick(st, hooks, reset);
+        next = std::min(next, st.next_interval_s);
+    }
+    return next;
+}
+
+// Primary keeps the historic names, others append their ident
+static std::string supply_name(const char* base, const Monitor& st) {
+    return st.primary ? std::string(base) : std::string(base) + "." + st.bp.ident;
+}
+
+static void open_supply(std::vector<Monitor>& mons, const BatteryPaths& bp) {
+    Monitor& st = mons.emplace_back();
+    st.bp = bp;
+    st.primary = mons.size() == 1;
+
+    // Voltage map
+    fs::path map_path = MAP_FILE;
+    if (!st.primary) map_path.replace_extension(bp.ident + map_path.extension().string());
+    st.store.path = map_path.string();
+    st.map = load_map(st.store);
+    std::error_code ec;
+    if (!fs::exists(st.store.path, ec)) {
+        mark_map_dirty(st.store); // first run, store the defaults once
+        flush_map(st.store, st.map, true);
+    }
+
+    open_history(st.history, supply_name(HISTORY_SHM, st));
+    st.export_slot = open_export_channel(bp.name, supply_name(EXPORT_SHM, st));
+}
+
+static void close_supply(Monitor& st) {
+    flush_map(st.store, st.map, true);
+    close_history(st.history);
+    close_export_channel(st.export_slot);
+    st.export_slot = -1;
+    close_attr(st.bp.status);
+    close_attr(st.bp.voltage_now);
+}
+
+// ========================= Event loop =========================
+// Sleeps in epoll_wait() until the sampling timer expires or a signal arrives, nothing else wakes us
+struct EventLoop {
+    int epfd = -1; // ours, or the one knubatd shares with IdleWatcher
+    int tick_fd = -1; // timerfd (CLOCK_BOOTTIME), every Monitor::next_interval_s
+    int tick_s = 0; // interval tick_fd is armed with
+    int uevent_fd = -1; // power_supply uevents, -1 if netlink is unavailable
+    int hooks_ifd = -1; // inotify on charging.d and discharging.d
+    int hooks_wd[2] = { -1, -1 }; // [charging]
+    std::vector<std::pair<std::string, int>> online; // POWER_SUPPLY_ONLINE per charger seen
+    int64_t suspended_ms = 0; // as of the last wakeup
+    bool tick = false, reset = false, resample = false; // asked for by the current batch of events
+    int idle_fd = -1; // subscription to IDLEWATCHER_SOCKET, -1 while IdleWatcher isn't there
+    int64_t idle_retry_ms = 0; // mono_ms() of the last connect attempt
+    std::string idle_line; // partial line from idle_fd
+};
+
+static bool epoll_add_fd(int epfd, int fd) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = ep_tag(fd);
+    return ::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+// Periodic, first expiry one interval from now (also restarts the phase after a reset sample)
+static void arm_tick(EventLoop& ev, int interval_s) {
+    itimerspec its{};
+    its.it_value.tv_sec = interval_s;
+    its.it_interval.tv_sec = interval_s;
+    ::timerfd_settime(ev.tick_fd, 0, &its, nullptr);
+    ev.tick_s = interval_s;
+}
+
+// Kernel uevent group; power_supply drivers send change@ on plug/unplug and status flips
+static void open_uevent_socket(EventLoop& ev) {
+    int fd = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return;
+    sockaddr_nl sa{};
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = 1;
+    if (::bind(fd, (sockaddr*)&sa, sizeof(sa)) < 0 || !epoll_add_fd(ev.epfd, fd)) {
+        ::close(fd);
+        return;
+    }
+    ev.uevent_fd = fd;
+}
 
-            if (reset && delta_pct >= 3) {
-                // reset + meaningful change: force write now
-                need_visible_update = true;
-            } else if (elapsed_s >= required_interval) {
-                need_visible_update = true;
+// True if a uevent says the charging state moved: a battery's POWER_SUPPLY_STATUS differs from
+// what the last sample read, or a charger's POWER_SUPPLY_ONLINE flipped. Batteries that appear
+// (controllers, docks) get a Monitor, removed ones lose theirs; the primary one is kept for good.
+// Other uevents are ignored.
+static bool handle_uevents(EventLoop& ev, std::vector<Monitor>& mons) {
+    bool resample = false;
+    char buf[4096];
+    for (;;) {
+        sockaddr_nl sa{};
+        socklen_t sl = sizeof(sa);
+        ssize_t n = ::recvfrom(ev.uevent_fd, buf, sizeof(buf) - 1, 0, (sockaddr*)&sa, &sl);
+        if (n < 0) {
+            if (errno == ENOBUFS) { resample = true; continue; } // lost some, just look
+            break;
+        }
+        if (sa.nl_pid != 0) continue; // kernel only
+        buf[n] = '\0';
+
+        const char *action = "", *subsystem = nullptr, *name = nullptr, *status = nullptr, *online = nullptr;
+        for (const char* p = buf + std::strlen(buf) + 1; p < buf + n; p += std::strlen(p) + 1) {
+            if (std::strncmp(p, "ACTION=", 7) == 0) action = p + 7;
+            else if (std::strncmp(p, "SUBSYSTEM=", 10) == 0) subsystem = p + 10;
+            else if (std::strncmp(p, "POWER_SUPPLY_NAME=", 18) == 0) name = p + 18;
+            else if (std::strncmp(p, "POWER_SUPPLY_STATUS=", 20) == 0) status = p + 20;
+            else if (std::strncmp(p, "POWER_SUPPLY_ONLINE=", 20) == 0) online = p + 20;
+        }
+        if (!subsystem || std::strcmp(subsystem, "power_supply") != 0 || !name) continue;
+
+        auto st = std::find_if(mons.begin(), mons.end(), [&](const Monitor& m) { return m.bp.name == name; });
+        if (st != mons.end()) {
+            if (std::strcmp(action, "remove") == 0 && !st->primary) {
+                close_supply(*st);
+                mons.erase(st);
+            } else if (status && parse_charge_status(status) != st->last_status) {
+                resample = true;
+            }
+        } else if (std::strcmp(action, "add") == 0 && !mons.empty() && (int)mons.size() < MAX_SUPPLIES &&
+                   is_extra_battery(fs::path("/sys/class/power_supply") / name)) {
+            open_supply(mons, battery_paths(fs::path("/sys/class/power_supply") / name));
+            resample = true;
+        } else if (online) {
+            const int on = std::atoi(online);
+            auto it = std::find_if(ev.online.begin(), ev.online.end(), [&](auto& o) { return o.first == name; });
+            if (it == ev.online.end()) {
+                ev.online.emplace_back(name, on);
+                resample = true; // new charger showed up
+            } else if (it->second != on) {
+                it->second = on;
+                resample = true;
             }
         }
+    }
+    return resample;
+}
 
-        if (need_visible_update) {
-            int new_visible = visible_percent;
+static constexpr uint32_t HOOK_DIR_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                         IN_CLOSE_WRITE | IN_ATTRIB;
+
+static void watch_hook_dirs(EventLoop& ev) {
+    ev.hooks_ifd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ev.hooks_ifd < 0) return;
+    ev.hooks_wd[1] = ::inotify_add_watch(ev.hooks_ifd, (fs::path(ROOT) / "charging.d").c_str(), HOOK_DIR_MASK);
+    ev.hooks_wd[0] = ::inotify_add_watch(ev.hooks_ifd, (fs::path(ROOT) / "discharging.d").c_str(), HOOK_DIR_MASK);
+    if (!epoll_add_fd(ev.epfd, ev.hooks_ifd)) {
+        ::close(ev.hooks_ifd);
+        ev.hooks_ifd = -1;
+    }
+}
 
-            if (first_visible) {
-                // Initial loop
-                new_visible = internal_percent;
-            } else if (reset && delta_pct >= 3) {
-                // reset + meaningful change: snap visible to internal
-                new_visible = internal_percent;
-            } else {
-                new_visible = step_limit(visible_percent, internal_percent, charging);
+// Apply file-level changes to the cache; a queue overflow rescans both directories
+static void handle_hook_dir_events(EventLoop& ev, HookCache& hc) {
+    alignas(inotify_event) char buf[4096];
+    bool rescan = false;
+    ssize_t r;
+    while ((r = ::read(ev.hooks_ifd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + r; ) {
+            const inotify_event* e = (const inotify_event*)p;
+            p += sizeof(inotify_event) + e->len;
+            if (e->mask & IN_Q_OVERFLOW) { rescan = true; continue; }
+            if (e->mask & IN_IGNORED) { // directory itself went away
+                for (int& wd : ev.hooks_wd) if (wd == e->wd) wd = -1;
+                rescan = true;
+                continue;
             }
+            if (!e->len) continue;
+            if (e->wd == ev.hooks_wd[1]) update_hook_entry(hc, true, e->name);
+            else if (e->wd == ev.hooks_wd[0]) update_hook_entry(hc, false, e->name);
+        }
+    }
+    if (!rescan) return;
+    load_hook_cache(hc); // also recreates missing directories
+    if (ev.hooks_wd[1] < 0)
+        ev.hooks_wd[1] = ::inotify_add_watch(ev.hooks_ifd, (fs::path(ROOT) / "charging.d").c_str(), HOOK_DIR_MASK);
+    if (ev.hooks_wd[0] < 0)
+        ev.hooks_wd[0] = ::inotify_add_watch(ev.hooks_ifd, (fs::path(ROOT) / "discharging.d").c_str(), HOOK_DIR_MASK);
+}
 
-            if (new_visible != visible_percent) {
-                visible_percent = new_visible;
-                fs::create_directories(fs::path(PERCENT_FILE).parent_path());
-                (void)write_atomic(PERCENT_FILE, std::to_string(visible_percent) + "\n", 0644);
-                last_visible_write = now;
-
-                // fire once and on exact 5% increments
-                if (visible_percent % 5 == 0) {
-                    int b = visible_percent;
-                    if (b != last_bucket) {
-                        run_bucket_hooks_cached(hooks, charging, visible_percent);
-                        last_bucket = b;
-                        hooks_fired = true; // we fired off hooks this loop
-                    }
-                }
-            }
+static void dump_hist(int fd, const char* name, const Histogram& h) {
+    dprintf(fd, "%s n=%llu avg=%llu max=%llu log2=", name, (unsigned long long)h.count,
+            (unsigned long long)(h.count ? h.sum / h.count : 0), (unsigned long long)h.max);
+    int last = 15;
+    while (last > 0 && !h.bucket[last]) --last;
+    for (int i = 0; i <= last; ++i) dprintf(fd, i ? ",%u" : "%u", h.bucket[i]);
+    dprintf(fd, "\n");
+}
+
+static void dump_stats(int fd) {
+    const Stats& s = g_stats;
+    dprintf(fd, "uptime_ms=%lld samples=%llu invalid_reads=%llu ema_wipes=%llu resets=%llu resumes=%llu uevent_resamples=%llu\n",
+            (long long)(mono_ms() - s.started_ms), (unsigned long long)s.samples,
+            (unsigned long long)s.invalid_reads, (unsigned long long)s.ema_wipes, (unsigned long long)s.resets,
+            (unsigned long long)s.resumes, (unsigned long long)s.uevent_resamples);
+    dprintf(fd, "idle level=%s\n", g_idle == IdleLevel::Extended ? "extended" : g_idle == IdleLevel::Idle ? "idle" : "active");
+    dprintf(fd, "visible written=%llu deferred=%llu\n",
+            (unsigned long long)s.visible_written, (unsigned long long)s.visible_deferred);
+    dprintf(fd, "hooks spawned=%llu failed=%llu dropped=%llu killed=%llu running=%zu\n",
+            (unsigned long long)s.hooks_spawned, (unsigned long long)s.hooks_failed,
+            (unsigned long long)s.hooks_dropped, (unsigned long long)s.hooks_killed, g_hooks.running.size());
+    dprintf(fd, "map flushes=%llu skipped=%llu failed=%llu\n", (unsigned long long)s.map_flushes,
+            (unsigned long long)s.map_flush_skipped, (unsigned long long)s.map_flush_failed);
+    dump_hist(fd, "sysfs_us", s.sysfs_us);
+    dump_hist(fd, "step_us", s.step_us);
+    dump_hist(fd, "hook_ms", s.hook_ms);
+}
+
+static bool open_event_loop(EventLoop& ev, int epfd) {
+    ev.epfd = epfd;
+    ev.tick_fd = ::timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    ev.suspended_ms = suspended_ms();
+    if (ev.tick_fd < 0 || !epoll_add_fd(ev.epfd, ev.tick_fd)) return false;
+    open_uevent_socket(ev); // optional, the tick still catches status changes without it
+    if (!init_hook_supervisor(ev.epfd)) return false;
+    watch_hook_dirs(ev); // without it the cache just stays as loaded
+    open_export(ev.epfd); // shm and socket are optional, PERCENT_FILE keeps working without them
+    return true;
+}
+
+// ========================= Simulator =========================
+// batteryplus simulate [TRACE] [--map FILE] [--curve FILE]
+// Feeds pipeline_step() a trace on a virtual clock, as fast as the CPU allows, and reports the
+// per-sample cost, convergence after plug/unplug/resume, visible percent error against the
+// reference column and how many writes and hooks the daemon would have done. Nothing is written.
+//
+// TRACE lines ('#' comments):
+//   t_s mv STATUS [ref_pct]    STATUS: C/D/F/N/U or the sysfs word, '_' for spaces (Not_charging)
+//   t_s resume                 the next sample takes the reset path
+// Without TRACE a synthetic ~14 h run is generated (discharge, charge, suspend, heavy discharge)
+// and sampled at the intervals the pipeline asks for.
+static constexpr int SIM_CONVERGED_PCT = 2; // |visible - reference| that counts as caught up
+
+struct TracePoint {
+    int64_t t_ms = 0;
+    int mv = -1;
+    ChargeStatus status = ChargeStatus::Unknown;
+    int ref_pct = -1; // -1 unknown
+    bool resume = false; // reset on this sample
+};
+
+static ChargeStatus parse_trace_status(std::string w) {
+    if (w == "C") return ChargeStatus::Charging;
+    if (w == "D") return ChargeStatus::Discharging;
+    if (w == "F") return ChargeStatus::Full;
+    if (w == "N") return ChargeStatus::NotCharging;
+    std::replace(w.begin(), w.end(), '_', ' ');
+    return parse_charge_status(w.c_str());
+}
+
+static bool load_trace(const char* path, std::vector<TracePoint>& out) {
+    std::ifstream f(path);
+    if (!f) return false;
+    std::string line;
+    bool resume = false;
+    while (std::getline(f, line)) {
+        line = line.substr(0, line.find('#'));
+        double t_s = 0.0;
+        int mv = 0, ref = -1;
+        char word[32] = {};
+        int n = std::sscanf(line.c_str(), "%lf %d %31s %d", &t_s, &mv, word, &ref);
+        if (n < 3) {
+            char ev[16] = {};
+            if (std::sscanf(line.c_str(), "%lf %15s", &t_s, ev) == 2 && std::strcmp(ev, "resume") == 0) resume = true;
+            continue;
         }
+        TracePoint tp;
+        tp.t_ms = (int64_t)std::llround(t_s * 1000.0);
+        tp.mv = mv >= 100000 ? mv / 1000 : mv; // same autodetect as read_voltage_mv()
+        tp.status = parse_trace_status(word);
+        tp.ref_pct = n >= 4 ? ref : -1;
+        tp.resume = resume;
+        resume = false;
+        out.push_back(tp);
+    }
+    return true;
+}
 
-        // Run wildcard scripts once on reset only if we didn't already
-        if (reset) {
-            if (!hooks_fired) {
-                const auto& any = charging ? hooks.charging_any : hooks.discharging_any;
-                run_paths(any);
-            }
+// Cell with a known state of charge: OCV follows the inverse of the default gamma curve over the
+// default map window, plus load sag, charger rise, noise and the odd spike
+struct Synth {
+    double soc = 90.0;
+    int64_t t_ms = 0;
+    uint32_t rng = 12345;
+    bool slept = false;
+};
+
+static TracePoint synth_next(Synth& sy, int64_t dt_ms) {
+    constexpr int64_t H = 3600 * 1000;
+    const int64_t t0 = sy.t_ms;
+    int64_t t = t0 + dt_ms;
+    TracePoint tp;
+
+    if (!sy.slept && t >= 5 * H) { // suspended for 2 h, 4% gone
+        sy.slept = true;
+        t += 2 * H;
+        sy.soc -= 4.0;
+        tp.resume = true;
+    }
+    const double h = (double)(t - t0) / H;
+    const bool charging = t >= 3 * H && t < 3 * H + 45 * 60 * 1000;
+    const bool heavy = t >= 7 * H;
+    if (charging) sy.soc = std::min(100.0, sy.soc + 50.0 * h);
+    else if (!tp.resume) sy.soc = std::max(0.0, sy.soc - (heavy ? 15.0 : 11.0) * h);
+    sy.t_ms = t;
+
+    sy.rng = sy.rng * 1664525u + 1013904223u;
+    const int noise = (int)(sy.rng >> 24) % 17 - 8; // +-8 mV
+    const int spike = ((sy.rng >> 8) & 63) == 0 ? ((sy.rng & 1) ? 40 : -40) : 0;
+
+    const double v_100_start = 3927.0; // build_curve() for the default map
+    const double ocv = DEFAULT_V_EMPTY + (v_100_start - DEFAULT_V_EMPTY) * std::pow(sy.soc / 100.0, 1.0 / 1.20);
+    int mv = (int)std::lround(ocv) + noise + spike;
+    if (charging) mv += 60;
+    else mv -= heavy ? 20 : 10;
+
+    tp.t_ms = t;
+    tp.mv = mv;
+    tp.status = charging ? (sy.soc >= 100.0 ? ChargeStatus::Full : ChargeStatus::Charging) : ChargeStatus::Discharging;
+    tp.ref_pct = (int)std::lround(sy.soc);
+    return tp;
+}
+
+struct SimReport {
+    long samples = 0;
+    int64_t virtual_ms = 0;
+    int64_t cpu_ns = 0;
+    int64_t cpu_ns_max = 0;
+    long err_n = 0;
+    double err_abs = 0.0, err_sq = 0.0, ierr_abs = 0.0;
+    int err_max = 0;
+    long events = 0, converged = 0;
+    int64_t conv_ms = 0, conv_ms_max = 0;
+    long writes = 0, hooks = 0, any_hooks = 0, map_changes = 0;
+};
+
+static inline int64_t thread_cpu_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int run_simulate(int argc, char** argv) {
+    const char* trace_path = nullptr;
+    const char* map_path = nullptr;
+    const char* curve_path = CURVE_FILE;
+    for (int i = 0; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--map") == 0 && i + 1 < argc) map_path = argv[++i];
+        else if (std::strcmp(argv[i], "--curve") == 0 && i + 1 < argc) curve_path = argv[++i];
+        else if (argv[i][0] != '-' && !trace_path) trace_path = argv[i];
+        else {
+            std::fprintf(stderr, "usage: batteryplus simulate [TRACE] [--map FILE] [--curve FILE]\n");
+            return 2;
         }
+    }
 
-        // Learn droop once when armed
-        if (droop_armed && !charging && discharging_streak >= 3) {
-            if (last_charging_ema_mv > 0 && v_med > 0) {
-                learn_vdroop(last_charging_ema_mv, v_med,map, MAP_FILE);
-            }
-            // Reset arming
-            droop_armed = false;
+    std::vector<TracePoint> trace;
+    if (trace_path && !load_trace(trace_path, trace)) {
+        std::fprintf(stderr, "batteryplus: Error: cannot read %s\n", trace_path);
+        return 1;
+    }
+    load_curve_profile(curve_path);
+
+    Monitor st;
+    st.primary = true;
+    if (map_path) {
+        st.store.path = map_path;
+        st.map = load_map(st.store); // read only
+    }
+
+    SimReport rep;
+    Synth sy;
+    size_t next = 0;
+    bool was_charging = false;
+    int64_t event_ms = -1; // virtual time of the last unconverged event
+    const int64_t start_ms = trace.empty() ? 0 : trace.front().t_ms;
+
+    for (;;) {
+        TracePoint tp;
+        if (trace_path) {
+            if (next >= trace.size()) break;
+            tp = trace[next++];
+        } else {
+            if (rep.samples > 0 && (sy.soc <= 0.0 || sy.t_ms > 16LL * 3600 * 1000)) break;
+            tp = synth_next(sy, rep.samples ? (int64_t)st.next_interval_s * 1000 : 0);
+        }
+
+        const int64_t c0 = thread_cpu_ns();
+        const StepResult r = pipeline_step(st, tp.mv, tp.status, tp.resume, tp.t_ms);
+        const int64_t cpu = thread_cpu_ns() - c0;
+        rep.cpu_ns += cpu;
+        rep.cpu_ns_max = std::max(rep.cpu_ns_max, cpu);
+        rep.samples++;
+        rep.virtual_ms = tp.t_ms - start_ms;
+
+        rep.writes += r.visible_changed;
+        rep.hooks += r.hook_bucket >= 0;
+        rep.any_hooks += r.run_any_hooks;
+        rep.map_changes += r.map_changed;
+
+        if (rep.samples > 1 && (r.charging != was_charging || tp.resume)) {
+            rep.events++;
+            event_ms = tp.t_ms;
+        }
+        was_charging = r.charging;
+
+        const int target = tp.ref_pct >= 0 ? tp.ref_pct : st.internal_percent;
+        if (event_ms >= 0 && std::abs(st.visible_percent - target) <= SIM_CONVERGED_PCT) {
+            const int64_t lat = tp.t_ms - event_ms;
+            rep.converged++;
+            rep.conv_ms += lat;
+            rep.conv_ms_max = std::max(rep.conv_ms_max, lat);
+            event_ms = -1;
+        }
+
+        if (tp.ref_pct >= 0) {
+            const int e = st.visible_percent - tp.ref_pct;
+            rep.err_n++;
+            rep.err_abs += std::abs(e);
+            rep.err_sq += (double)e * e;
+            rep.ierr_abs += std::abs(st.internal_percent - tp.ref_pct);
+            rep.err_max = std::max(rep.err_max, std::abs(e));
+        }
+    }
+
+    std::printf("source=%s curve=%s map=%d/%d/%d\n", trace_path ? trace_path : "synthetic",
+                g_curve_profile.name.c_str(), st.map.V_FULL, st.map.V_EMPTY, st.map.V_DROOP);
+    std::printf("samples=%ld virtual_h=%.2f\n", rep.samples, rep.virtual_ms / 3600000.0);
+    std::printf("cpu_ns_per_sample avg=%lld max=%lld\n",
+                (long long)(rep.samples ? rep.cpu_ns / rep.samples : 0), (long long)rep.cpu_ns_max);
+    if (rep.err_n) {
+        std::printf("visible_err_pct mean=%.2f rms=%.2f max=%d internal_mean=%.2f n=%ld\n",
+                    rep.err_abs / rep.err_n, std::sqrt(rep.err_sq / rep.err_n), rep.err_max,
+                    rep.ierr_abs / rep.err_n, rep.err_n);
+    }
+    std::printf("convergence_s events=%ld converged=%ld avg=%lld max=%lld (within %d%%)\n",
+                rep.events, rep.converged, (long long)(rep.converged ? rep.conv_ms / rep.converged / 1000 : 0),
+                (long long)(rep.conv_ms_max / 1000), SIM_CONVERGED_PCT);
+    std::printf("writes=%ld hooks=%ld any_hooks=%ld map_changes=%ld\n",
+                rep.writes, rep.hooks, rep.any_hooks, rep.map_changes);
+    return 0;
+}
+
+// ========================= Module =========================
+// main() and knubatd (../Knubatd) drive the daemon through these: whoever owns the loop owns the
+// epoll set and the signals, and hands over every fd it doesn't recognise itself
+struct Daemon {
+    EventLoop ev;
+    HookCache hooks;
+    std::vector<Monitor> mons;
+};
+static Daemon g_daemon;
+
+// Back to ACTIVE resamples at once instead of finishing the long interval, and the visible
+// percent snaps if it fell behind
+static void batteryplus_set_idle(IdleLevel level) {
+    if (level == g_idle) return;
+    if (level == IdleLevel::Active) {
+        for (Monitor& st : g_daemon.mons) st.snap_pending = true;
+        g_daemon.ev.resample = true;
+    }
+    g_idle = level;
+}
+
+// IdleWatcher sends the current state on connect and a "state=active|idle|extended ..." line per
+// transition. Without it, or after it went away, sampling is as if ACTIVE.
+static bool g_idle_socket = true; // knubatd clears it and passes IdleWatcher's state in directly
+
+static void connect_idlewatcher(EventLoop& ev) {
+    ev.idle_retry_ms = mono_ms();
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    std::snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", IDLEWATCHER_SOCKET);
+    epoll_event e{};
+    e.events = EPOLLIN | EPOLLRDHUP;
+    e.data.u64 = ep_tag(fd);
+    if (::connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0 || ::epoll_ctl(ev.epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+        ::close(fd);
+        return;
+    }
+    ev.idle_fd = fd;
+    ev.idle_line.clear();
+}
+
+static void handle_idlewatcher(EventLoop& ev) {
+    char buf[256];
+    ssize_t n;
+    while ((n = ::recv(ev.idle_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        ev.idle_line.append(buf, n);
+        size_t nl;
+        while ((nl = ev.idle_line.find('\n')) != std::string::npos) {
+            const std::string line = ev.idle_line.substr(0, nl);
+            ev.idle_line.erase(0, nl + 1);
+            if (line.rfind("state=active", 0) == 0) batteryplus_set_idle(IdleLevel::Active);
+            else if (line.rfind("state=idle", 0) == 0) batteryplus_set_idle(IdleLevel::Idle);
+            else if (line.rfind("state=extended", 0) == 0) batteryplus_set_idle(IdleLevel::Extended);
         }
+        if (ev.idle_line.size() > sizeof(buf)) ev.idle_line.clear(); // not IdleWatcher
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        ::close(ev.idle_fd); // also leaves the epoll set
+        ev.idle_fd = -1;
+        batteryplus_set_idle(IdleLevel::Active);
+    }
+}
+
+// Directories, hooks, curve, batteries and their event sources on epfd, then the first sample.
+// false after a message if there is no battery or setup failed.
+static bool batteryplus_open(int epfd) {
+    Daemon& d = g_daemon;
+    g_stats.started_ms = mono_ms();
+
+    // Ensure directories exist
+    fs::create_directories(fs::path(ROOT));
+    fs::create_directories(fs::path(ROOT) / "charging.d");
+    fs::create_directories(fs::path(ROOT) / "discharging.d");
+
+    load_hook_cache(d.hooks);
+    load_curve_profile(CURVE_FILE);
 
-        // Remember last charging voltage for next loop
-        if (charging) {
-            last_charging_ema_mv = voltage_ema_mv;
+    // Find batteries
+    auto found = find_batteries();
+    if (found.empty()) {
+        std::fprintf(stderr, "batteryplus: Error: No battery detected!\n");
+        return false;
+    }
+
+    std::error_code ec;
+    fs::create_directories(fs::path(MAP_FILE).parent_path(), ec);
+
+    if (!open_event_loop(d.ev, epfd)) {
+        std::fprintf(stderr, "batteryplus: Error: event loop setup failed: %s\n", std::strerror(errno));
+        return false;
+    }
+
+    d.mons.reserve(MAX_SUPPLIES);
+    for (const auto& bp : found) open_supply(d.mons, bp);
+    if (g_idle_socket) connect_idlewatcher(d.ev);
+
+    arm_tick(d.ev, sample_all(d.mons, d.hooks, false));
+    return true;
+}
+
+// One ready fd; false if it isn't ours. Sampling waits for batteryplus_after_batch().
+static bool batteryplus_dispatch(uint64_t tag) {
+    if (!(tag & EP_OWNER)) return false;
+    const int fd = (int)(uint32_t)tag;
+    Daemon& d = g_daemon;
+    EventLoop& ev = d.ev;
+    if (fd == ev.tick_fd) {
+        uint64_t expirations;
+        (void)::read(ev.tick_fd, &expirations, sizeof(expirations));
+        ev.tick = true;
+    } else if (fd == ev.uevent_fd) {
+        if (handle_uevents(ev, d.mons)) {
+            ev.resample = true;
+            g_stats.uevent_resamples++;
         }
+    } else if (fd == g_export.sfd) {
+        accept_export_clients(ev.epfd);
+    } else if (handle_export_client(fd)) {
+        // client fd, handled
+    } else if (fd == ev.hooks_ifd) {
+        handle_hook_dir_events(ev, d.hooks);
+    } else if (fd == ev.idle_fd) {
+        handle_idlewatcher(ev);
+    } else if (is_hook_fd(fd)) {
+        if (fd == g_hooks.timer_fd) {
+            uint64_t expirations;
+            (void)::read(g_hooks.timer_fd, &expirations, sizeof(expirations));
+        }
+        reap_hooks();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// SIGUSR1 resets, SIGUSR2 dumps counters; SIGTERM/SIGINT are batteryplus_close()
+static void batteryplus_signal(int signo) {
+    if (signo == SIGUSR1) g_daemon.ev.reset = true;
+    else if (signo == SIGUSR2) dump_stats(STDERR_FILENO);
+}
+
+// Once per epoll_wait() return, after its events: samples if the tick, a uevent, SIGUSR1 or a
+// resume asked for it
+static void batteryplus_after_batch() {
+    Daemon& d = g_daemon;
+    EventLoop& ev = d.ev;
+
+    // Resumed since the last wakeup: same as SIGUSR1
+    const int64_t slept = suspended_ms();
+    if (slept - ev.suspended_ms >= SUSPEND_DETECT_MS) {
+        ev.reset = true;
+        g_stats.resumes++;
+    }
+    ev.suspended_ms = slept;
+    if (ev.reset) g_stats.resets++;
+
+    if (ev.reset || ev.resample) {
+        if (ev.resample) for (Monitor& st : d.mons) st.settle = SETTLE_SAMPLES;
+        arm_tick(ev, sample_all(d.mons, d.hooks, ev.reset)); // sample right away, next one a full interval later
+    } else if (ev.tick) {
+        int next = sample_all(d.mons, d.hooks, false);
+        if (next != ev.tick_s) arm_tick(ev, next);
+    }
+    if (g_idle_socket && ev.tick && ev.idle_fd < 0 && mono_ms() - ev.idle_retry_ms >= IDLEWATCHER_RETRY_S * 1000)
+        connect_idlewatcher(ev);
+    ev.tick = ev.reset = ev.resample = false;
+}
 
-        // Sleep
-        for (int i = 0; i < INTERNAL_INTERVAL_S && g_running; ++i) {
-            if (g_reset.load()) break;
-            std::this_thread::sleep_for(1s);
+// Flush learned map values, for SIGTERM/SIGINT
+static void batteryplus_close() {
+    for (Monitor& st : g_daemon.mons) flush_map(st.store, st.map, true);
+}
+
+// ========================= Main =========================
+#ifndef KNUBAT_UNIFIED
+int main(int argc, char** argv) {
+    if (argc >= 2 && std::strcmp(argv[1], "simulate") == 0) return run_simulate(argc - 2, argv + 2);
+    if (argc >= 2) {
+        std::fprintf(stderr, "usage: batteryplus [simulate [TRACE] [--map FILE] [--curve FILE]]\n");
+        return 2;
+    }
+
+    // Signals are blocked and read from a signalfd in the event loop
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    ::sigprocmask(SIG_BLOCK, &sigs, nullptr);
+
+    const int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    const int sig_fd = ::signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (epfd < 0 || sig_fd < 0 || !epoll_add_fd(epfd, sig_fd)) {
+        std::fprintf(stderr, "batteryplus: Error: event loop setup failed: %s\n", std::strerror(errno));
+        return 1;
+    }
+    if (!batteryplus_open(epfd)) return 1;
+
+    bool running = true;
+    std::array<epoll_event, 8> events{};
+    while (running) {
+        int n = ::epoll_wait(epfd, events.data(), (int)events.size(), -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::fprintf(stderr, "batteryplus: Error: epoll_wait: %s\n", std::strerror(errno));
+            return 1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            const uint64_t tag = events[i].data.u64;
+            if ((int)(uint32_t)tag == sig_fd) {
+                signalfd_siginfo si;
+                while (::read(sig_fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                    if (si.ssi_signo == SIGTERM || si.ssi_signo == SIGINT) running = false;
+                    else batteryplus_signal((int)si.ssi_signo);
+                }
+            } else {
+                batteryplus_dispatch(tag);
+            }
+        }
+        if (!running) {
+            batteryplus_close();
+            break;
         }
+        batteryplus_after_batch();
     }
 
     return 0;
 }
+#endif
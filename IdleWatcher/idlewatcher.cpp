@@ -16,38 +16,78 @@
 //
 // States: ACTIVE, IDLE, EXTENDED
 // Timers loaded from config with sane defaults (min 60s / max 12h)
-// Writes 1/0 to /var/run/idle.state (1 = ACTIVE, 0 = IDLE/EXTENDED)
+// Writes 1/0 to /var/run/idle.state (1 = ACTIVE, 0 = IDLE/EXTENDED), state_file=0 turns it off
+// Publishes transitions on a unix socket (state_socket=, default /var/run/idlewatcher.sock):
+//   clients get the current state on connect, then one line per transition:
+//   "state=idle ts=<realtime ms> idle_ms=<ms since last activity>"
 // Runs hook scripts in /etc/idlewatcher/{idle.d,extended.d,active.d}
 //   IDLE -> run scripts with arg "idle"
 //   EXTENDED -> run scripts with arg "extended"
 //   ACTIVE -> run scripts with arg "active"
 // Config has hooks_mirror= for secondary/mirrored hook scripts location
-// Watches /dev/input/event*
-// EV_ABS counts as activity only if delta ≥ AXIS_DZ_PCT
+// Hooks are posix_spawn'ed and supervised via pidfd in the main loop:
+//   hook_timeout= (s, 0 = none), hook_max_parallel=, hooks_ordered=1 runs a directory one by one
+//   A new transition drops hooks still queued from the previous one
+//   Hook directories are indexed once and re-scanned only on inotify changes; one that is missing
+//   is looked for again on each transition that would run it
+// Watches /dev/input/event* via netlink uevents (hotplug=uevent, default) or inotify (hotplug=inotify):
+//   uevents are BPF-filtered kernel-side, waits for udev's processed events when udevd runs,
+//   capabilities from the uevent skip unwanted devices before opening, failed opens retry with backoff
+// Skips devices that can't produce activity; input_allow=/input_deny= filter by class, name: or phys:
+// EV_ABS counts as activity only if delta ≥ AXIS_DZ_PCT (ABS_MISC, pressure and other sensor axes ignored)
+// abs_adaptive=1 learns a per-axis noise floor from sustained small oscillation (worn or vibrating
+//   sticks) and keeps the axis reference on the drifted rest position; floors persist per device
+//   (EVIOCGID + uniq) in noise_file=, saved at most once a minute and on SIGTERM/SIGINT
+// Installs an EVIOCSMASK client mask so other event types are dropped kernel-side
 // Throttles pulses to reduce excessive work
+// Timers are absolute CLOCK_BOOTTIME deadlines, so time spent suspended counts towards idle;
+//   a deadline that passed while suspended waits RESUME_GRACE_MS for the wake input before it applies,
+//   the idle deadline is rounded up to timer_slack_ms= and only re-armed when it moves earlier
+// Parks input devices for the debounce window after a pulse, then flushes their backlog
 // Creates hook directories on startup if missing
+// Low battery tier: low_battery_idle=/low_battery_extended= (default 300/900 s, 0 = keep idle=/extended=)
+//   apply while BatteryPlus's shared record (battery_record=, default /batteryplus, empty turns it off)
+//   shows a discharging battery at or below low_battery_pct= (default 10); read lock-free whenever a
+//   deadline is computed, nothing is polled
+// SIGHUP or saving idlewatcher.conf reloads the config in place (state_socket= needs a restart)
+// SIGUSR2 dumps runtime counters to stderr; "stats" sent on the state socket replies with the same
+// idlewatcher --replay [--repeat N] [--config FILE] trace.evemu...
+//   Offline benchmark: runs evemu-record captures through the activity logic on a simulated clock
+// Also runs as a module of knubatd (../Knubatd/knubatd.cpp), sharing one process and epoll loop with BatteryPlus
 // Build arm: aarch64-linux-gnu-g++ -O3 -flto -std=gnu++20 -Wall -Wextra -pedantic idlewatcher.cpp -o idlewatcher
 // Build x86: g++ -O3 -flto -std=gnu++20 -Wall -Wextra -pedantic idlewatcher.cpp -o idlewatcher
 
 #include <algorithm>
 #include <array>
+#include <arpa/inet.h>
 #include <cerrno>
 #include <cmath>
+#include <cstddef>
 #include <csignal>
 #include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <dirent.h>
 #include <fcntl.h>
+#include <linux/filter.h>
 #include <linux/input.h>
+#include <linux/netlink.h>
+#include <spawn.h>
 #include <string>
 #include <sys/epoll.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <vector>
@@ -55,18 +95,90 @@
 // ========== Config and constants ==========
 static constexpr int    DEFAULT_IDLE_S = 900; // 15 minutes
 static constexpr int    DEFAULT_EXTENDED_S = 3600; // 60 minutes
+static constexpr int    DEFAULT_LOW_BATTERY_PCT = 10; // BatteryPlus's LOW_PCT_THRESHOLD
+static constexpr int    DEFAULT_LOW_BATTERY_IDLE_S = 300;
+static constexpr int    DEFAULT_LOW_BATTERY_EXTENDED_S = 900;
+static int LOW_BATTERY_PCT = DEFAULT_LOW_BATTERY_PCT;
+static int LOW_BATTERY_IDLE_S = DEFAULT_LOW_BATTERY_IDLE_S; // 0: idle= applies on low battery too
+static int LOW_BATTERY_EXTENDED_S = DEFAULT_LOW_BATTERY_EXTENDED_S; // 0: extended= applies
+static const char* DEFAULT_BATTERY_RECORD = "/batteryplus"; // shm_open() name, /dev/shm/batteryplus
+static std::string BATTERY_RECORD = DEFAULT_BATTERY_RECORD; // empty: no battery tier
+static constexpr int BATTERY_RETRY_MS = 60000; // shm_open() of a missing record at most this often
+static constexpr int64_t BATTERY_STALE_MS = 15 * 60000; // record older than this is ignored (CLOCK_MONOTONIC)
+static constexpr int BATTERY_RECHECK_MS = 60000; // discharging past the low battery deadline: percent looked at this often
 static constexpr double DEFAULT_AXIS_DZ_PCT = 0.15; // 15%
 static constexpr int    AXIS_DZ_MIN = 64; // small floor
 static constexpr int    AXIS_DZ_BADSPAN = 128; // fallback just in case
 static double AXIS_DZ_PCT = DEFAULT_AXIS_DZ_PCT; // runtime deadzone, overridden by config
+static bool ABS_ADAPTIVE = false; // learn per-axis noise floors on top of the fixed deadzone
+static constexpr int    NOISE_WINDOW = 32; // samples per classification window
+static constexpr int    NOISE_REVERSALS = 10; // direction changes in a window that mean jitter
+static constexpr double NOISE_MAX_PCT = 0.40; // a learned floor stays below this share of span
+static constexpr int    NOISE_SAVE_MS = 60000;
 
 static const int DEBOUNCE_MS = 3000; // global debounce
+static constexpr int SUSPEND_DETECT_MS = 2000; // BOOTTIME - MONOTONIC grew this much since the last wakeup = resumed
+static constexpr int RESUME_GRACE_MS = 1500; // state deadlines that passed while suspended wait this long for the wake input
+
+static constexpr int DEFAULT_TIMER_SLACK_MS = 1000;
+static int TIMER_SLACK_MS = DEFAULT_TIMER_SLACK_MS; // idle deadline granularity and re-arm tolerance
+
+static constexpr int DEFAULT_HOOK_TIMEOUT_S = 30;
+static constexpr int DEFAULT_HOOK_MAX_PARALLEL = 4;
+static constexpr int HOOK_MAX_PARALLEL_CAP = 32;
+static constexpr int HOOK_REAP_POLL_MS = 250; // only used when pidfd_open() is unavailable
+static int  HOOK_TIMEOUT_S = DEFAULT_HOOK_TIMEOUT_S;
+static int  HOOK_MAX_PARALLEL = DEFAULT_HOOK_MAX_PARALLEL;
+static bool HOOKS_ORDERED = false;
 
 static const char* CONFIG_FILE = "/etc/idlewatcher/idlewatcher.conf";
+static const char* CONFIG_NAME = "idlewatcher.conf"; // inside HOOKS_ROOT, watched for reloads
 static const char* STATE_FILE = "/var/run/idle.state";
 static const char* HOOKS_ROOT = "/etc/idlewatcher";
 static const char* INPUT_DIR  = "/dev/input";
+static const char* DEFAULT_NOISE_FILE = "/etc/idlewatcher/abs_noise";
+static std::string NOISE_FILE = DEFAULT_NOISE_FILE; // learned floors, empty: not persisted
 static std::string HOOKS_MIRROR; // optional secondary hooks
+static const char* DEFAULT_STATE_SOCKET = "/var/run/idlewatcher.sock";
+static std::string STATE_SOCKET = DEFAULT_STATE_SOCKET; // empty disables
+static bool STATE_FILE_ENABLED = true; // compatibility for /var/run/idle.state pollers
+static constexpr int MAX_CLIENTS = 16;
+static bool HOTPLUG_UEVENT = true; // false: inotify on INPUT_DIR; needs a restart to change
+static constexpr int HOTPLUG_RETRY_MS = 100; // first retry of a failed open, doubles per attempt
+static constexpr int HOTPLUG_RETRY_MAX_MS = 5000;
+static constexpr int HOTPLUG_RETRIES = 8;
+
+// Device classes for input_allow=/input_deny=, derived from EVIOCGBIT/EVIOCGPROP
+enum : unsigned {
+    DC_KEYBOARD = 1u << 0,
+    DC_MOUSE    = 1u << 1,
+    DC_GAMEPAD  = 1u << 2,
+    DC_TOUCH    = 1u << 3,
+    DC_ACCEL    = 1u << 4,
+    DC_SWITCH   = 1u << 5,
+    DC_POWER    = 1u << 6, // only power/sleep keys
+    DC_OTHER    = 1u << 7,
+};
+
+static const struct { const char* name; unsigned cls; } DEV_CLASS_NAMES[] = {
+    { "keyboard", DC_KEYBOARD }, { "mouse", DC_MOUSE }, { "gamepad", DC_GAMEPAD },
+    { "touch", DC_TOUCH }, { "accelerometer", DC_ACCEL }, { "switch", DC_SWITCH },
+    { "power", DC_POWER }, { "other", DC_OTHER },
+};
+
+static const char* DEFAULT_INPUT_DENY = "accelerometer,power";
+
+struct DevRules {
+    unsigned cls{0};
+    std::vector<std::string> names; // substring of EVIOCGNAME
+    std::vector<std::string> phys;  // substring of EVIOCGPHYS
+};
+
+struct DevPolicy {
+    DevRules allow; // wins over deny
+    DevRules deny;
+};
+static DevPolicy INPUT_POLICY;
 
 static inline void die(const char* fmt, ...) __attribute__((noreturn));
 
@@ -82,35 +194,186 @@ static inline void die(const char* fmt, ...) {
 // ========== Types and globals ==========
 enum class State { ACTIVE, IDLE, EXTENDED };
 
+// Leading part of BatteryPlus's ExportRecord (version 1 fields), all we read
+struct BatteryRecord {
+    uint32_t magic; // BATTERY_MAGIC once initialised
+    uint16_t version;
+    uint16_t size;
+    uint32_t seq; // odd while BatteryPlus is writing
+    int32_t  percent; // visible
+    int32_t  internal_percent;
+    int32_t  ema_mv;
+    int32_t  raw_mv;
+    uint8_t  charging;
+    uint8_t  status;
+    uint8_t  pad[2];
+    int64_t  updated_ms; // CLOCK_MONOTONIC
+};
+static constexpr uint32_t BATTERY_MAGIC = 0x534c5042; // "BPLS"
+
+static constexpr uint8_t NO_AXIS = 0xff;
+
+// Per-axis state, only for axes the device actually has
+struct AbsAxis {
+    int  last{0};
+    int  dz{0};
+    int  span{0}; // max - min, kept so a reload can recompute dz
+    uint32_t dz_rejects{0};
+    uint8_t code{0};
+    bool seen{false};
+    bool hat{false};
+
+    // abs_adaptive
+    int  noise{0}; // learned floor, used when above dz
+    int  prev{0}; // previous raw value
+    int  win_min{0}, win_max{0};
+    uint8_t win_n{0}, reversals{0};
+    int8_t dir{0};
+};
+
 struct Dev {
-    int fd{-1};
-    std::string path;
+    int fd{-1}; // -1 while the pool slot is free
+    int event_no{-1}; // N of /dev/input/eventN
+    char name[48]{};
+    char id[96]{}; // bus:vendor:product:version:uniq, keys the noise floors
+    bool noise_dirty{false};
+
+    // counters, see dump_stats()
+    uint64_t wakeups{0};
+    uint64_t events{0};
+    uint64_t bytes{0};
+    uint64_t pulses{0};
 
-    int  abs_last[ABS_MAX+1];
-    bool abs_seen[ABS_MAX+1];
-    int  abs_min[ABS_MAX+1];
-    int  abs_max[ABS_MAX+1];
-    int  abs_dz[ABS_MAX+1];
+    uint8_t abs_idx[ABS_MAX+1]; // ABS code -> index into axes, NO_AXIS if absent
+    std::vector<AbsAxis> axes;
 
     Dev() {
-        memset(abs_last, 0, sizeof(abs_last));
-        memset(abs_seen, 0, sizeof(abs_seen));
-        memset(abs_min, 0, sizeof(abs_min));
-        memset(abs_max, 0, sizeof(abs_max));
-        memset(abs_dz, 0, sizeof(abs_dz));
+        memset(abs_idx, NO_AXIS, sizeof(abs_idx));
     }
 };
 
+enum HookKind { HK_IDLE, HK_EXTENDED, HK_ACTIVE, HK_COUNT };
+static const char* const HOOK_SUBDIRS[HK_COUNT] = { "idle.d", "extended.d", "active.d" };
+static const char* const HOOK_ARGS[HK_COUNT]    = { "idle", "extended", "active" };
+static constexpr int HOOK_ROOTS = 2; // HOOKS_ROOT, HOOKS_MIRROR
+
+// Pre-sorted, pre-validated executables of one hook directory
+struct HookDir {
+    std::string dir; // empty when unused (no hooks_mirror)
+    int wd{-1};
+    bool dirty{false}; // inotify saw a change, re-scan after the event batch
+    uint32_t gen{0}; // bumped per scan, queued jobs from an older scan are dropped
+    std::vector<std::string> exes; // full paths, sorted by name
+};
+
+struct HookJob {
+    uint16_t dir; // index into RT.hook_dirs
+    uint16_t idx; // index into HookDir::exes
+    uint32_t gen;
+    uint32_t group; // one per directory run, for hooks_ordered=1
+    const char* arg;
+};
+
+struct HookChild {
+    int64_t started_ms{0};
+    pid_t pid{-1};
+    int pidfd{-1}; // -1 on kernels without pidfd_open, reaped by polling
+    uint32_t group{0};
+    int64_t deadline_ms{0}; // 0 = no timeout
+    bool killed{false};
+};
+
+// Device node that failed to open, retried from RT.retry_timer
+struct PendingDev {
+    int num; // eventN
+    int tries;
+    int64_t next_ms;
+};
+
+// Hot-path counters, fixed size; dumped on SIGUSR2 or a "stats" request
+struct Stats {
+    int64_t  started_ms{0};
+    uint64_t wakeups{0}; // epoll_wait returns
+    uint64_t input_wakeups{0};
+    uint64_t events{0};
+    uint64_t bytes{0};
+    uint64_t discarded[EV_CNT]{}; // by type, events that couldn't count as activity
+    uint64_t after_pulse{0}; // drained unparsed once a batch had pulsed
+    uint64_t flushed{0}; // dropped by unpark_inputs()
+    uint64_t pulses{0};
+    uint64_t debounced{0};
+    uint64_t dz_rejects{0};
+    uint64_t parks{0};
+    uint64_t hooks_spawned{0};
+    uint64_t hooks_failed{0};
+    uint64_t hooks_killed{0};
+    uint64_t hook_ms_total{0};
+    uint64_t hook_ms_max{0};
+    uint64_t transitions{0};
+    uint64_t reloads{0};
+    uint64_t timer_arms{0}; // state timer timerfd_settime calls
+    uint64_t resume_defers{0}; // state deadlines put off by RESUME_GRACE_MS after a resume
+    uint64_t uevents{0}; // input uevents that passed the socket filter
+    uint64_t prefiltered{0}; // devices skipped on uevent capabilities, never opened
+    uint64_t open_retries{0};
+    uint64_t open_gave_up{0};
+    uint64_t noise_raises{0};
+    int64_t  state_ms[3]{}; // indexed by State
+    int64_t  state_since{0};
+} STATS;
+
+static std::vector<std::pair<int64_t, State>>* SIM_TIMELINE = nullptr; // set while replaying
+
+// epoll_event.data.u64 tags; every registration carries EP_OWNER, so an epoll set shared with
+// another module (knubatd) routes on it; control fds carry EP_OWNER plus the fd
+static constexpr uint64_t EP_OWNER = 1ull << 40;
+static constexpr uint64_t EP_DEV  = 1ull << 32; // low 32 bits: device pool slot
+static constexpr uint64_t EP_HOOK = 1ull << 33; // low 32 bits: hook pid
+static constexpr uint64_t EP_CLIENT = 1ull << 34; // low 32 bits: client fd
+
+// timerfd plus the deadline it was last armed for; with fd -1 (replay) only the deadline is kept
+struct Timer {
+    int fd{-1};
+    int64_t deadline_ms{0}; // 0 = disarmed
+};
+
 struct Runtime {
     int epfd{-1};
-    int tfd{-1};
+    Timer state_timer;
     int ifd{-1};
-    std::vector<Dev> devices;
+    Timer debounce_timer; // unparks input devices
+    Timer hook_timer; // hook deadlines
+    Timer retry_timer; // pending device opens
+    int nlfd{-1}; // NETLINK_KOBJECT_UEVENT
+    bool nl_udev{false}; // bound to udev's multicast group rather than the kernel's
+    int input_wd{-1}; // only without nlfd
+    int conf_wd{-1};
+    int sigfd{-1}; // SIGHUP, SIGUSR2, SIGTERM, SIGINT; standalone main() only
+    bool reload_pending{false}; // SIGHUP or idlewatcher.conf saved, reloaded after the batch
+    HookDir hook_dirs[HOOK_ROOTS * HK_COUNT];
+    std::vector<HookJob> hook_queue; // keeps its capacity, no allocation per transition
+    std::vector<HookChild> hook_children;
+    uint32_t hook_group{0};
+    int sfd{-1}; // state socket listener
+    int clients[MAX_CLIENTS];
+    int nclients{0};
+    std::deque<Dev> devices; // slot pool, addresses stay put; indexed by epoll tag
+    std::vector<uint32_t> free_slots;
+    std::vector<int> slot_by_event; // eventN -> slot, -1 if not open
+    std::vector<PendingDev> pending;
     int64_t last_activity_ms{0};
     int64_t last_pulse_ms{0};
+    bool parked{false}; // inputs left disarmed until the debounce window ends
+    bool noise_dirty{false}; // some device learned a floor since the last save
+    int64_t noise_saved_ms{0};
+    int64_t suspended_ms{0}; // BOOTTIME - MONOTONIC as of the last wakeup
     State state{State::ACTIVE};
     int idle_s{DEFAULT_IDLE_S};
     int extended_s{DEFAULT_EXTENDED_S};
+    const BatteryRecord* battery{nullptr}; // mapped BATTERY_RECORD
+    int64_t battery_tried_ms{0}; // last shm_open() attempt
+    int battery_pct{-1}; // discharging percent as of the last deadline, -1 unknown or charging
+    bool low_battery{false}; // low_battery_* timeouts in force
 } RT;
 
 // ========== Helpers ==========
@@ -118,12 +381,62 @@ static inline bool is_hat_abs(int code) {
     return code >= ABS_HAT0X && code <= ABS_HAT3Y;
 }
 
+// Axes that reflect a user moving something; the rest are sensor/contact metadata
+static inline bool is_activity_abs(int code) {
+    switch (code) {
+        case ABS_PRESSURE: case ABS_DISTANCE: case ABS_TILT_X: case ABS_TILT_Y:
+        case ABS_TOOL_WIDTH: case ABS_VOLUME: case ABS_MISC:
+            return false;
+        default: break;
+    }
+    if (code >= ABS_MT_SLOT && code <= ABS_MT_TOOL_Y)
+        return code == ABS_MT_POSITION_X || code == ABS_MT_POSITION_Y || code == ABS_MT_TRACKING_ID;
+    return true;
+}
+
+// Keeps running across suspend, unlike CLOCK_MONOTONIC
 static inline int64_t now_ms() {
     timespec ts{};
-    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    clock_gettime(CLOCK_BOOTTIME, &ts);
     return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+static void arm_timerfd_abs(int fd, int64_t deadline_ms) {
+    itimerspec its{}; // zero struct disarms
+    if (deadline_ms > 0) {
+        its.it_value.tv_sec = deadline_ms / 1000;
+        its.it_value.tv_nsec = (deadline_ms % 1000) * 1000000;
+    }
+    if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, nullptr) < 0) {
+        die("timerfd_settime: %s", strerror(errno));
+    }
+}
+
+static void set_timer(Timer& t, int64_t deadline_ms) {
+    t.deadline_ms = deadline_ms;
+    if (t.fd >= 0) arm_timerfd_abs(t.fd, deadline_ms);
+}
+
+static inline void arm_timer(Timer& t, int64_t now, int64_t ms) {
+    set_timer(t, ms > 0 ? now + ms : 0);
+}
+
+// For deadlines that mostly move later (the idle deadline on every pulse): round up to
+// TIMER_SLACK_MS so wakeups land on a shared grid, and leave an earlier armed deadline alone:
+// it fires early and the handler re-arms. Re-arm only when it must fire sooner than the slack allows.
+static bool arm_timer_lazy(Timer& t, int64_t now, int64_t ms) {
+    if (ms <= 0) {
+        if (t.deadline_ms == 0) return false;
+        set_timer(t, 0);
+        return true;
+    }
+    int64_t d = now + ms;
+    if (TIMER_SLACK_MS > 1) d = (d + TIMER_SLACK_MS - 1) / TIMER_SLACK_MS * TIMER_SLACK_MS;
+    if (t.deadline_ms > now && t.deadline_ms - d <= TIMER_SLACK_MS) return false;
+    set_timer(t, d);
+    return true;
+}
+
 static int parse_pos_int(const char* s) {
     long v = strtol(s, nullptr, 10);
     if (v < 0 || v > 12 * 60 * 60) return -1; // clamp to 12h max
@@ -142,10 +455,29 @@ static inline bool is_event_name(const char* s) {
     return true;
 }
 
+// input_allow=/input_deny= lists: "gamepad, name:Xbox, phys:usb-0000:00:14.0" etc.
+static void parse_dev_rules(const char* val, DevRules& r) {
+    r = DevRules{};
+    std::string tok;
+    for (const char* p = val; ; ++p) {
+        if (*p && *p != ',' && *p != ' ' && *p != '\t') { tok += *p; continue; }
+        if (!tok.empty()) {
+            if (tok.rfind("name:", 0) == 0)       r.names.push_back(tok.substr(5));
+            else if (tok.rfind("phys:", 0) == 0)  r.phys.push_back(tok.substr(5));
+            else {
+                for (auto& c : DEV_CLASS_NAMES)
+                    if (tok == c.name) { r.cls |= c.cls; break; }
+            }
+            tok.clear();
+        }
+        if (!*p) break;
+    }
+}
+
 // ======== Config load and layout ==========
 // dirs
-static void ensure_dir(const std::string& p) {
-    if (mkdir(p.c_str(), 0755) < 0 && errno != EEXIST)
+static void ensure_dir(const std::string& p, bool fatal = true) {
+    if (mkdir(p.c_str(), 0755) < 0 && errno != EEXIST && fatal)
         die("mkdir %s: %s", p.c_str(), strerror(errno));
 }
 
@@ -160,10 +492,35 @@ static void ensure_default_config(){
         "idle=%d\n"
         "extended=%d\n"
         "ABS_Deadzone=%.3f\n"
-        "hooks_mirror=\n",
+        "hooks_mirror=\n"
+        "input_allow=\n"
+        "input_deny=%s\n"
+        "hook_timeout=%d\n"
+        "hook_max_parallel=%d\n"
+        "hooks_ordered=0\n"
+        "state_socket=%s\n"
+        "state_file=1\n"
+        "timer_slack_ms=%d\n"
+        "hotplug=uevent\n"
+        "abs_adaptive=0\n"
+        "noise_file=%s\n"
+        "low_battery_pct=%d\n"
+        "low_battery_idle=%d\n"
+        "low_battery_extended=%d\n"
+        "battery_record=%s\n",
         DEFAULT_IDLE_S,
         DEFAULT_EXTENDED_S,
-        DEFAULT_AXIS_DZ_PCT
+        DEFAULT_AXIS_DZ_PCT,
+        DEFAULT_INPUT_DENY,
+        DEFAULT_HOOK_TIMEOUT_S,
+        DEFAULT_HOOK_MAX_PARALLEL,
+        DEFAULT_STATE_SOCKET,
+        DEFAULT_TIMER_SLACK_MS,
+        DEFAULT_NOISE_FILE,
+        DEFAULT_LOW_BATTERY_PCT,
+        DEFAULT_LOW_BATTERY_IDLE_S,
+        DEFAULT_LOW_BATTERY_EXTENDED_S,
+        DEFAULT_BATTERY_RECORD
     );
     fclose(f);
 }
@@ -174,6 +531,21 @@ static void read_config_or_defaults(int &idle_s, int &extended_s) {
     extended_s  = DEFAULT_EXTENDED_S;
     AXIS_DZ_PCT = DEFAULT_AXIS_DZ_PCT;
     HOOKS_MIRROR.clear();
+    HOOK_TIMEOUT_S = DEFAULT_HOOK_TIMEOUT_S;
+    HOOK_MAX_PARALLEL = DEFAULT_HOOK_MAX_PARALLEL;
+    HOOKS_ORDERED = false;
+    STATE_SOCKET = DEFAULT_STATE_SOCKET;
+    STATE_FILE_ENABLED = true;
+    TIMER_SLACK_MS = DEFAULT_TIMER_SLACK_MS;
+    HOTPLUG_UEVENT = true;
+    ABS_ADAPTIVE = false;
+    NOISE_FILE = DEFAULT_NOISE_FILE;
+    LOW_BATTERY_PCT = DEFAULT_LOW_BATTERY_PCT;
+    LOW_BATTERY_IDLE_S = DEFAULT_LOW_BATTERY_IDLE_S;
+    LOW_BATTERY_EXTENDED_S = DEFAULT_LOW_BATTERY_EXTENDED_S;
+    BATTERY_RECORD = DEFAULT_BATTERY_RECORD;
+    parse_dev_rules("", INPUT_POLICY.allow);
+    parse_dev_rules(DEFAULT_INPUT_DENY, INPUT_POLICY.deny);
 
     FILE* f = fopen(CONFIG_FILE, "r");
     if (!f) return;
@@ -208,6 +580,42 @@ static void read_config_or_defaults(int &idle_s, int &extended_s) {
         if (n >= 60) extended_s = n;
       } else if (strcmp(key, "hooks_mirror") == 0) {
         if (*val) HOOKS_MIRROR = val;
+      } else if (strcmp(key, "hook_timeout") == 0) {
+        int n = parse_pos_int(val);
+        if (n >= 0) HOOK_TIMEOUT_S = n;
+      } else if (strcmp(key, "hook_max_parallel") == 0) {
+        int n = parse_pos_int(val);
+        if (n >= 1) HOOK_MAX_PARALLEL = n > HOOK_MAX_PARALLEL_CAP ? HOOK_MAX_PARALLEL_CAP : n;
+      } else if (strcmp(key, "hooks_ordered") == 0) {
+        HOOKS_ORDERED = (atoi(val) != 0);
+      } else if (strcmp(key, "state_socket") == 0) {
+        STATE_SOCKET = val;
+      } else if (strcmp(key, "state_file") == 0) {
+        STATE_FILE_ENABLED = (atoi(val) != 0);
+      } else if (strcmp(key, "timer_slack_ms") == 0) {
+        int n = parse_pos_int(val);
+        if (n >= 0) TIMER_SLACK_MS = n > 60000 ? 60000 : n;
+      } else if (strcmp(key, "hotplug") == 0) {
+        HOTPLUG_UEVENT = strcmp(val, "inotify") != 0;
+      } else if (strcmp(key, "abs_adaptive") == 0) {
+        ABS_ADAPTIVE = (atoi(val) != 0);
+      } else if (strcmp(key, "noise_file") == 0) {
+        NOISE_FILE = val;
+      } else if (strcmp(key, "low_battery_pct") == 0) {
+        int n = parse_pos_int(val);
+        if (n >= 0) LOW_BATTERY_PCT = n > 100 ? 100 : n;
+      } else if (strcmp(key, "low_battery_idle") == 0) {
+        int n = parse_pos_int(val);
+        if (n == 0 || n >= 60) LOW_BATTERY_IDLE_S = n;
+      } else if (strcmp(key, "low_battery_extended") == 0) {
+        int n = parse_pos_int(val);
+        if (n == 0 || n >= 60) LOW_BATTERY_EXTENDED_S = n;
+      } else if (strcmp(key, "battery_record") == 0) {
+        BATTERY_RECORD = val;
+      } else if (strcmp(key, "input_allow") == 0) {
+        parse_dev_rules(val, INPUT_POLICY.allow);
+      } else if (strcmp(key, "input_deny") == 0) {
+        parse_dev_rules(val, INPUT_POLICY.deny);
       } else if (strcmp(key, "ABS_Deadzone") == 0) {
         // Accept either percent like "20" or ratio like "0.2"
         char* end = nullptr;
@@ -225,17 +633,21 @@ static void read_config_or_defaults(int &idle_s, int &extended_s) {
     // enforce minimums
     if (idle_s < 60) idle_s = 60;
     if (extended_s < 60) extended_s = 60;
+    // the low battery tier only ever shortens
+    if (LOW_BATTERY_IDLE_S > idle_s) LOW_BATTERY_IDLE_S = idle_s;
+    if (LOW_BATTERY_EXTENDED_S > extended_s) LOW_BATTERY_EXTENDED_S = extended_s;
 }
 
-static void ensure_hooks_root_layout(const std::string& root) {
-    ensure_dir(root);
-    ensure_dir(root + "/idle.d");
-    ensure_dir(root + "/extended.d");
-    ensure_dir(root + "/active.d");
+static void ensure_hooks_root_layout(const std::string& root, bool fatal = true) {
+    ensure_dir(root, fatal);
+    ensure_dir(root + "/idle.d", fatal);
+    ensure_dir(root + "/extended.d", fatal);
+    ensure_dir(root + "/active.d", fatal);
 }
 
 // ========== Hooks and state file ========
 static void write_state(State s){
+    if (!STATE_FILE_ENABLED) return;
     int val = (s == State::ACTIVE) ? 1 : 0;
     FILE* f = fopen(STATE_FILE, "w");
     if (f) {
@@ -244,39 +656,324 @@ static void write_state(State s){
     }
 }
 
-static void run_folder(const std::string& dir, const char*arg) {
-    DIR* d = opendir(dir.c_str());
-    if (!d) return;
+// ----- state subscription socket -----
+static const char* state_name(State s) {
+    switch (s) {
+        case State::ACTIVE:   return "active";
+        case State::IDLE:     return "idle";
+        case State::EXTENDED: return "extended";
+    }
+    return "active";
+}
 
-    std::vector<std::string> items;
-    dirent* e;
+static inline int64_t realtime_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    while((e = readdir(d))) {
-        if (e->d_name[0] == '.') continue;
-        items.emplace_back(e->d_name);
+static void drop_client(int i) {
+    close(RT.clients[i]); // also drops it from epoll
+    RT.clients[i] = RT.clients[--RT.nclients];
+}
+
+static int format_state(char* buf, size_t n, int64_t now) {
+    const int64_t idle = now > RT.last_activity_ms ? now - RT.last_activity_ms : 0;
+    return snprintf(buf, n, "state=%s ts=%lld idle_ms=%lld\n",
+                    state_name(RT.state), (long long)realtime_ms(), (long long)idle);
+}
+
+// A client that can't take one short line right now is too far behind to keep
+static bool send_client(int fd, const char* msg, int len) {
+    return send(fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT) == len;
+}
+
+static void publish_state(int64_t now) {
+    if (RT.nclients == 0) return;
+    char msg[96];
+    int len = format_state(msg, sizeof(msg), now);
+    for (int i = RT.nclients; i-- > 0; )
+        if (!send_client(RT.clients[i], msg, len)) drop_client(i);
+}
+
+static void open_state_socket() {
+    if (STATE_SOCKET.empty()) return;
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    if (STATE_SOCKET.size() >= sizeof(sa.sun_path)) die("state_socket path too long: %s", STATE_SOCKET.c_str());
+    memcpy(sa.sun_path, STATE_SOCKET.c_str(), STATE_SOCKET.size() + 1);
+
+    RT.sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (RT.sfd < 0) die("socket: %s", strerror(errno));
+    unlink(sa.sun_path); // stale socket from a previous run
+    if (bind(RT.sfd, (sockaddr*)&sa, sizeof(sa)) < 0) die("bind %s: %s", sa.sun_path, strerror(errno));
+    chmod(sa.sun_path, 0666); // state isn't sensitive, let unprivileged UI clients subscribe
+    if (listen(RT.sfd, 8) < 0) die("listen: %s", strerror(errno));
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = EP_OWNER | (uint32_t)RT.sfd;
+    if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, RT.sfd, &ev) < 0)
+        die("epoll add sfd: %s", strerror(errno));
+}
+
+static void accept_clients(int64_t now) {
+    int fd;
+    while ((fd = accept4(RT.sfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (RT.nclients >= MAX_CLIENTS) { close(fd); continue; }
+        char msg[96];
+        int len = format_state(msg, sizeof(msg), now);
+        if (!send_client(fd, msg, len)) { close(fd); continue; }
+
+        epoll_event ev{}; ev.events = EPOLLIN | EPOLLRDHUP; ev.data.u64 = EP_OWNER | EP_CLIENT | (uint32_t)fd;
+        if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) { close(fd); continue; }
+        RT.clients[RT.nclients++] = fd;
     }
-    closedir(d);
+}
+
+static void dump_stats(int fd, int64_t now) {
+    int64_t state_ms[3];
+    memcpy(state_ms, STATS.state_ms, sizeof(state_ms));
+    state_ms[(int)RT.state] += now - STATS.state_since;
+    uint64_t other = 0;
+    for (int t = EV_MSC + 1; t < EV_CNT; ++t) other += STATS.discarded[t];
+
+    dprintf(fd, "uptime_ms=%lld state=%s transitions=%llu reloads=%llu timer_arms=%llu resume_defers=%llu\n",
+            (long long)(now - STATS.started_ms), state_name(RT.state),
+            (unsigned long long)STATS.transitions, (unsigned long long)STATS.reloads,
+            (unsigned long long)STATS.timer_arms, (unsigned long long)STATS.resume_defers);
+    dprintf(fd, "state_ms active=%lld idle=%lld extended=%lld\n",
+            (long long)state_ms[(int)State::ACTIVE], (long long)state_ms[(int)State::IDLE],
+            (long long)state_ms[(int)State::EXTENDED]);
+    dprintf(fd, "wakeups=%llu input_wakeups=%llu events=%llu bytes=%llu after_pulse=%llu flushed=%llu\n",
+            (unsigned long long)STATS.wakeups, (unsigned long long)STATS.input_wakeups,
+            (unsigned long long)STATS.events, (unsigned long long)STATS.bytes,
+            (unsigned long long)STATS.after_pulse, (unsigned long long)STATS.flushed);
+    dprintf(fd, "discarded syn=%llu key=%llu rel=%llu abs=%llu msc=%llu other=%llu\n",
+            (unsigned long long)STATS.discarded[EV_SYN], (unsigned long long)STATS.discarded[EV_KEY],
+            (unsigned long long)STATS.discarded[EV_REL], (unsigned long long)STATS.discarded[EV_ABS],
+            (unsigned long long)STATS.discarded[EV_MSC], (unsigned long long)other);
+    dprintf(fd, "pulses=%llu debounced=%llu parks=%llu dz_rejects=%llu noise_raises=%llu\n",
+            (unsigned long long)STATS.pulses, (unsigned long long)STATS.debounced,
+            (unsigned long long)STATS.parks, (unsigned long long)STATS.dz_rejects,
+            (unsigned long long)STATS.noise_raises);
+    dprintf(fd, "hooks spawned=%llu failed=%llu killed=%llu running=%d queued=%zu total_ms=%llu max_ms=%llu\n",
+            (unsigned long long)STATS.hooks_spawned, (unsigned long long)STATS.hooks_failed,
+            (unsigned long long)STATS.hooks_killed, (int)RT.hook_children.size(), RT.hook_queue.size(),
+            (unsigned long long)STATS.hook_ms_total, (unsigned long long)STATS.hook_ms_max);
+    dprintf(fd, "hotplug mode=%s uevents=%llu prefiltered=%llu open_retries=%llu gave_up=%llu pending=%zu\n",
+            RT.nlfd < 0 ? "inotify" : RT.nl_udev ? "udev" : "kernel",
+            (unsigned long long)STATS.uevents, (unsigned long long)STATS.prefiltered,
+            (unsigned long long)STATS.open_retries, (unsigned long long)STATS.open_gave_up, RT.pending.size());
+    dprintf(fd, "battery record=%s pct=%d low=%d idle_s=%d extended_s=%d\n",
+            RT.battery ? "mapped" : "none", RT.battery_pct, (int)RT.low_battery,
+            RT.low_battery && LOW_BATTERY_IDLE_S ? LOW_BATTERY_IDLE_S : RT.idle_s,
+            RT.low_battery && LOW_BATTERY_EXTENDED_S ? LOW_BATTERY_EXTENDED_S : RT.extended_s);
+
+    for (auto& d : RT.devices) {
+        if (d.fd < 0) continue;
+        dprintf(fd, "dev event%d \"%s\" wakeups=%llu events=%llu bytes=%llu pulses=%llu",
+                d.event_no, d.name, (unsigned long long)d.wakeups, (unsigned long long)d.events,
+                (unsigned long long)d.bytes, (unsigned long long)d.pulses);
+        for (auto& ax : d.axes) {
+            if (ax.dz_rejects) dprintf(fd, " abs%d_dz_rejects=%u", ax.code, ax.dz_rejects);
+            if (ax.noise) dprintf(fd, " abs%d_noise=%d", ax.code, ax.noise);
+        }
+        dprintf(fd, "\n");
+    }
+    dprintf(fd, "end\n");
+}
 
-    std::sort(items.begin(), items.end());
+// Clients only listen apart from "stats"; anything else is discarded, EOF/error closes them
+static void handle_client(int fd) {
+    int i = 0;
+    while (i < RT.nclients && RT.clients[i] != fd) ++i;
+    if (i == RT.nclients) return;
 
-    for(auto& fn : items) {
-        std::string path = dir + "/" + fn;
+    char buf[256];
+    for (;;) {
+        ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            if (memmem(buf, n, "stats", 5)) dump_stats(fd, now_ms());
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        drop_client(i);
+        return;
+    }
+}
+
+// ----- hook supervisor -----
+static posix_spawnattr_t HOOK_ATTR;
+
+// Children get default dispositions and an empty mask whatever the daemon blocks
+static void init_hook_spawnattr() {
+    sigset_t none, all;
+    sigemptyset(&none);
+    sigfillset(&all);
+    posix_spawnattr_init(&HOOK_ATTR);
+    posix_spawnattr_setsigmask(&HOOK_ATTR, &none);
+    posix_spawnattr_setsigdefault(&HOOK_ATTR, &all);
+    posix_spawnattr_setflags(&HOOK_ATTR, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+}
+
+static inline int pidfd_open_compat(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid; errno = ENOSYS; return -1;
+#endif
+}
+
+static bool spawn_hook(const HookJob& j, int64_t now) {
+    const HookDir& hd = RT.hook_dirs[j.dir];
+    if (j.gen != hd.gen || j.idx >= hd.exes.size()) return false; // directory changed since queued
+    char* argv[] = { (char*)hd.exes[j.idx].c_str(), (char*)j.arg, nullptr };
+    pid_t pid;
+    if (posix_spawn(&pid, argv[0], nullptr, &HOOK_ATTR, argv, environ) != 0) { ++STATS.hooks_failed; return false; }
+    ++STATS.hooks_spawned;
+
+    HookChild c;
+    c.started_ms = now;
+    c.pid = pid;
+    c.group = j.group;
+    c.deadline_ms = HOOK_TIMEOUT_S > 0 ? now + (int64_t)HOOK_TIMEOUT_S * 1000 : 0;
+    c.pidfd = pidfd_open_compat(pid); // still a zombie if it already exited, so this can't race
+    if (c.pidfd >= 0) {
+        fcntl(c.pidfd, F_SETFD, FD_CLOEXEC);
+        epoll_event ev{}; ev.events = EPOLLIN; ev.data.u64 = EP_OWNER | EP_HOOK | (uint32_t)pid;
+        if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, c.pidfd, &ev) < 0) { close(c.pidfd); c.pidfd = -1; }
+    }
+    RT.hook_children.push_back(c);
+    return true;
+}
+
+static bool group_running(uint32_t group) {
+    for (auto& c : RT.hook_children)
+        if (c.group == group) return true;
+    return false;
+}
+
+// Next hook deadline, or a short poll while any child has no pidfd to wake us
+static void arm_hook_timer(int64_t now) {
+    int64_t next = 0;
+    for (auto& c : RT.hook_children) {
+        int64_t at = 0;
+        if (c.pidfd < 0) at = now + HOOK_REAP_POLL_MS;
+        if (c.deadline_ms > 0 && !c.killed && (at == 0 || c.deadline_ms < at)) at = c.deadline_ms;
+        if (at > 0 && (next == 0 || at < next)) next = at;
+    }
+    arm_timer(RT.hook_timer, now, next > 0 ? (next > now ? next - now : 1) : 0);
+}
+
+// Start queued hooks up to HOOK_MAX_PARALLEL; with hooks_ordered=1 only the head of each directory
+// (a directory's jobs are queued contiguously, so its head is the first job after a group change)
+static void pump_hooks(int64_t now) {
+    auto& q = RT.hook_queue;
+    for (size_t i = 0; i < q.size() && (int)RT.hook_children.size() < HOOK_MAX_PARALLEL; ) {
+        if (HOOKS_ORDERED) {
+            bool head = (i == 0 || q[i - 1].group != q[i].group);
+            if (!head || group_running(q[i].group)) { ++i; continue; }
+        }
+        spawn_hook(q[i], now);
+        q.erase(q.begin() + i);
+    }
+    arm_hook_timer(now);
+}
+
+// pidfd readable or hook timer fired: reap what exited, kill what overran
+static void reap_hooks(int64_t now) {
+    for (size_t i = 0; i < RT.hook_children.size(); ) {
+        HookChild& c = RT.hook_children[i];
+        int st;
+        pid_t r = waitpid(c.pid, &st, WNOHANG);
+        if (r == c.pid || (r < 0 && errno == ECHILD)) {
+            const uint64_t dur = now > c.started_ms ? (uint64_t)(now - c.started_ms) : 0;
+            STATS.hook_ms_total += dur;
+            if (dur > STATS.hook_ms_max) STATS.hook_ms_max = dur;
+            if (c.pidfd >= 0) close(c.pidfd); // also drops it from epoll
+            RT.hook_children[i] = RT.hook_children.back();
+            RT.hook_children.pop_back();
+            continue;
+        }
+        if (c.deadline_ms > 0 && !c.killed && now >= c.deadline_ms) {
+            kill(c.pid, SIGKILL);
+            c.killed = true;
+            ++STATS.hooks_killed;
+        }
+        ++i;
+    }
+    pump_hooks(now);
+}
+
+// ----- hook directory index -----
+static constexpr uint32_t HOOK_DIR_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                          IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// Also (re)adds the watch while there is none: the directory was missing at index time or got removed
+static void scan_hook_dir(HookDir& hd) {
+    hd.dirty = false;
+    ++hd.gen;
+    hd.exes.clear();
+    if (hd.dir.empty()) return;
+    if (hd.wd < 0) hd.wd = inotify_add_watch(RT.ifd, hd.dir.c_str(), HOOK_DIR_MASK);
+
+    DIR* d = opendir(hd.dir.c_str());
+    if (!d) return;
+
+    dirent* e;
+    while((e = readdir(d))) {
+        if (e->d_name[0] == '.') continue;
+        std::string path = hd.dir + "/" + e->d_name;
         struct stat st{};
         if (stat(path.c_str(), &st) != 0) continue;
         if(!S_ISREG(st.st_mode) || (st.st_mode&S_IXUSR) == 0) continue;
+        hd.exes.push_back(std::move(path));
+    }
+    closedir(d);
+
+    std::sort(hd.exes.begin(), hd.exes.end());
+}
 
-        pid_t pid = fork();
-        if(pid == 0) {
-            execl(path.c_str(), path.c_str(), arg, (char*)nullptr);
-            _exit(127);
+// (Re)point one root's idle.d/extended.d/active.d at `root` and index them; empty root disables it
+static void index_hook_root(int root, const std::string& path) {
+    for (int k = 0; k < HK_COUNT; ++k) {
+        HookDir& hd = RT.hook_dirs[root * HK_COUNT + k];
+        if (hd.wd >= 0) {
+            bool shared = false; // same directory watched by the other root shares the wd
+            for (auto& o : RT.hook_dirs) if (&o != &hd && o.wd == hd.wd) shared = true;
+            if (!shared) inotify_rm_watch(RT.ifd, hd.wd);
+            hd.wd = -1;
         }
+        hd.dir = path.empty() ? std::string() : path + "/" + HOOK_SUBDIRS[k];
+        scan_hook_dir(hd);
     }
 }
 
-static inline void run_hook_roots(const char* subdir, const char* arg) {
-    run_folder(std::string(HOOKS_ROOT) + "/" + subdir, arg);
-    if (!HOOKS_MIRROR.empty())
-        run_folder(HOOKS_MIRROR + "/" + subdir, arg);
+static void hook_dir_event(int wd, uint32_t mask) {
+    for (auto& hd : RT.hook_dirs) {
+        if (wd >= 0 && hd.wd != wd) continue; // wd -1: queue overflow, re-scan everything
+        if (mask & IN_IGNORED) hd.wd = -1; // directory itself went away
+        hd.dirty = true;
+    }
+}
+
+static void refresh_hook_dirs() {
+    for (auto& hd : RT.hook_dirs)
+        if (hd.dirty) scan_hook_dir(hd);
+}
+
+static void run_hook_roots(HookKind kind, int64_t now) {
+    RT.hook_queue.clear(); // superseded transition, its hooks no longer apply
+    for (int root = 0; root < HOOK_ROOTS; ++root) {
+        const int di = root * HK_COUNT + kind;
+        HookDir& hd = RT.hook_dirs[di];
+        if (hd.wd < 0 && !hd.dir.empty()) scan_hook_dir(hd); // unwatched, may have been created since
+        const uint32_t group = ++RT.hook_group;
+        for (size_t i = 0; i < hd.exes.size(); ++i)
+            RT.hook_queue.push_back(HookJob{ (uint16_t)di, (uint16_t)i, hd.gen, group, HOOK_ARGS[kind] });
+    }
+    pump_hooks(now);
 }
 
 // ======== State machine and timers ==========
@@ -285,105 +982,451 @@ static inline int64_t effective_idle_ms(int64_t now) {
     return delta > 0 ? delta : 0;
 }
 
-// timer helpers
-static void arm_timer_ms(int64_t ms) {
-    itimerspec its{}; // zero struct disarms
-    if (ms > 0) {
-        its.it_value.tv_sec = ms / 1000;
-        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+static inline int64_t mono_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Total time spent suspended since boot
+static inline int64_t suspended_ms() {
+    return now_ms() - mono_ms();
+}
+
+// Visible percent from BatteryPlus's shared record while discharging; -1 if charging, missing or
+// stale. Lock-free: read seq, copy, read seq again; retry if odd or changed.
+// tried_ms = 0 retries on the next call, now waits BATTERY_RETRY_MS
+static void unmap_battery(int64_t tried_ms) {
+    if (RT.battery) munmap((void*)RT.battery, sizeof(BatteryRecord));
+    RT.battery = nullptr;
+    RT.battery_tried_ms = tried_ms;
+}
+
+static int battery_percent(int64_t now) {
+    if (BATTERY_RECORD.empty()) return -1;
+    if (!RT.battery) {
+        if (RT.battery_tried_ms && now - RT.battery_tried_ms < BATTERY_RETRY_MS) return -1;
+        RT.battery_tried_ms = now;
+        int fd = shm_open(BATTERY_RECORD.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        struct stat st{};
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(BatteryRecord))
+            p = mmap(nullptr, sizeof(BatteryRecord), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd); // the mapping stays and survives BatteryPlus restarts, not the supply going away
+        if (p == MAP_FAILED) return -1;
+        RT.battery = (const BatteryRecord*)p;
     }
-    if(timerfd_settime(RT.tfd, 0, &its, nullptr) < 0) {
-        die("timerfd_settime: %s", strerror(errno));
+    for (int tries = 0; tries < 4; ++tries) {
+        const uint32_t seq = __atomic_load_n(&RT.battery->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        BatteryRecord r;
+        memcpy(&r, RT.battery, sizeof(r));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&RT.battery->seq, __ATOMIC_RELAXED) != seq) continue;
+        // not a BatteryPlus record, or nobody updated it (supply removed, BatteryPlus gone): shm_open again later
+        if (r.magic != BATTERY_MAGIC || (r.updated_ms > 0 && mono_ms() - r.updated_ms > BATTERY_STALE_MS)) {
+            unmap_battery(now);
+            return -1;
+        }
+        if (r.percent < 0 || r.updated_ms <= 0) return -1;
+        return r.charging ? -1 : r.percent;
     }
+    return -1;
+}
+
+// idle=/extended=, or the low_battery_* ones while discharging at or below low_battery_pct
+static void timeouts_ms(int64_t now, int64_t& idle_ms, int64_t& ext_ms) {
+    RT.battery_pct = battery_percent(now);
+    RT.low_battery = RT.battery_pct >= 0 && RT.battery_pct <= LOW_BATTERY_PCT;
+    idle_ms = (int64_t)(RT.low_battery && LOW_BATTERY_IDLE_S ? LOW_BATTERY_IDLE_S : RT.idle_s) * 1000;
+    ext_ms  = (int64_t)(RT.low_battery && LOW_BATTERY_EXTENDED_S ? LOW_BATTERY_EXTENDED_S : RT.extended_s) * 1000;
+}
+
+// Without input IDLE/EXTENDED only go back to ACTIVE if neither tier would be idle yet (config
+// reload lengthening idle=), never because the charger came back
+static inline int64_t min_idle_ms() {
+    const int s = LOW_BATTERY_IDLE_S && !BATTERY_RECORD.empty() ? LOW_BATTERY_IDLE_S : RT.idle_s;
+    return (int64_t)s * 1000;
+}
+
+static inline void arm_state_timer(int64_t now, int64_t ms) {
+    if (arm_timer_lazy(RT.state_timer, now, ms)) ++STATS.timer_arms;
 }
 
 static void schedule_timer(int64_t now) {
-    const int64_t idle_ms = (int64_t)RT.idle_s * 1000;
-    const int64_t ext_ms  = (int64_t)RT.extended_s * 1000;
+    int64_t idle_ms, ext_ms;
+    timeouts_ms(now, idle_ms, ext_ms);
 
-    if (RT.state == State::EXTENDED) { arm_timer_ms(0); return; }
+    if (RT.state == State::EXTENDED) { arm_state_timer(now, 0); return; }
 
     const int64_t eff_since = effective_idle_ms(now);
+    // discharging but not low yet: also wake at the low battery deadline, and every
+    // BATTERY_RECHECK_MS once it passed, and look again; the percent may get there without any
+    // input to reschedule us
+    const bool recheck = !RT.low_battery && RT.battery_pct >= 0;
+    auto low_cap = [](int64_t remain, int64_t low_remain) {
+        return std::min(remain, low_remain > 0 ? low_remain : (int64_t)BATTERY_RECHECK_MS);
+    };
+    const int64_t low_idle_ms = (int64_t)(LOW_BATTERY_IDLE_S ? LOW_BATTERY_IDLE_S : RT.idle_s) * 1000;
+    const int64_t low_ext_ms  = (int64_t)(LOW_BATTERY_EXTENDED_S ? LOW_BATTERY_EXTENDED_S : RT.extended_s) * 1000;
 
     if (RT.state == State::ACTIVE) {
         int64_t remain = idle_ms - eff_since;
-        arm_timer_ms(remain > 1 ? remain : 1);
+        if (recheck) remain = low_cap(remain, low_idle_ms - eff_since);
+        arm_state_timer(now, remain > 1 ? remain : 1);
         return;
     }
     if (RT.state == State::IDLE) {
         int64_t remain = (idle_ms + ext_ms) - eff_since;
-        arm_timer_ms(remain > 1 ? remain : 1);
+        if (recheck) remain = low_cap(remain, (low_idle_ms + low_ext_ms) - eff_since);
+        arm_state_timer(now, remain > 1 ? remain : 1);
         return;
     }
-    arm_timer_ms(0);
+    arm_state_timer(now, 0);
 }
 
-static void enter(State to) {
+static void enter(State to, int64_t now) {
     if (to == RT.state) return;
+    STATS.state_ms[(int)RT.state] += now - STATS.state_since;
+    STATS.state_since = now;
+    ++STATS.transitions;
     RT.state = to;
+    if (SIM_TIMELINE) SIM_TIMELINE->emplace_back(now, to);
     write_state(to);
+    publish_state(now);
 
     if (to == State::ACTIVE)
-        run_hook_roots("active.d", "active");
+        run_hook_roots(HK_ACTIVE, now);
     else if (to == State::IDLE)
-        run_hook_roots("idle.d", "idle");
+        run_hook_roots(HK_IDLE, now);
     else if (to == State::EXTENDED)
-        run_hook_roots("extended.d", "extended");
+        run_hook_roots(HK_EXTENDED, now);
 }
 
-static void on_activity(int64_t now) {
-    if(now - RT.last_pulse_ms < DEBOUNCE_MS) return; // global debounce
+// Nothing read during the debounce window can change state, so stop reading:
+// devices are registered EPOLLONESHOT and simply aren't re-armed until the debounce timer fires
+static void park_inputs(int64_t now) {
+    RT.parked = true;
+    ++STATS.parks;
+    arm_timer(RT.debounce_timer, now, DEBOUNCE_MS);
+}
+
+// true if the pulse was accepted
+static bool on_activity(int64_t now) {
+    if(now - RT.last_pulse_ms < DEBOUNCE_MS) { ++STATS.debounced; return false; } // global debounce
+    ++STATS.pulses;
     RT.last_pulse_ms = now;
     RT.last_activity_ms = now;
-    if(RT.state != State::ACTIVE) enter(State::ACTIVE);
+    if(RT.state != State::ACTIVE) enter(State::ACTIVE, now);
     schedule_timer(now);
+    park_inputs(now);
+    return true;
 }
 
 static void reevaluate(int64_t now) {
     const int64_t eff_since = effective_idle_ms(now);
-    const int64_t idle_ms = (int64_t)RT.idle_s * 1000;
-    const int64_t ext_ms  = (int64_t)RT.extended_s * 1000;
+    int64_t idle_ms, ext_ms;
+    timeouts_ms(now, idle_ms, ext_ms);
 
     if (RT.state == State::ACTIVE) {
-        if (eff_since >= idle_ms) enter(State::IDLE);
+        if (eff_since >= idle_ms) enter(State::IDLE, now);
     } else if (RT.state == State::IDLE) {
-        if (eff_since < idle_ms) enter(State::ACTIVE);
-        else if (eff_since >= (idle_ms + ext_ms)) enter(State::EXTENDED);
+        if (eff_since < min_idle_ms()) enter(State::ACTIVE, now);
+        else if (eff_since >= (idle_ms + ext_ms)) enter(State::EXTENDED, now);
     } else {
-        if (eff_since < idle_ms) enter(State::ACTIVE);
+        if (eff_since < min_idle_ms()) enter(State::ACTIVE, now);
     }
     schedule_timer(now);
 }
 
 // ========== Device discovery and input handling =========
-static Dev* dev_by_fd(int fd) {
-    for (auto &d : RT.devices)
-        if (d.fd == fd) return &d;
-    return nullptr;
+// ----- adaptive noise floor -----
+// Many direction changes inside a small peak-to-peak is jitter: raise the floor to cover it and move
+// the reference to the middle of it. Wide or one-way windows are real movement and teach nothing.
+static void learn_noise(Dev& dv, AbsAxis& ax, int val) {
+    if (ax.win_n == 0) {
+        ax.win_min = ax.win_max = val;
+        ax.reversals = 0; ax.dir = 0;
+    } else {
+        const int8_t dir = val > ax.prev ? 1 : val < ax.prev ? -1 : 0;
+        if (dir && ax.dir && dir != ax.dir) ++ax.reversals;
+        if (dir) ax.dir = dir;
+        ax.win_min = std::min(ax.win_min, val);
+        ax.win_max = std::max(ax.win_max, val);
+    }
+    ax.prev = val;
+    if (++ax.win_n < NOISE_WINDOW) return;
+    ax.win_n = 0;
+
+    const int pp = ax.win_max - ax.win_min;
+    const int cap = ax.span > 0 ? (int)(ax.span * NOISE_MAX_PCT) : AXIS_DZ_BADSPAN * 2;
+    if (ax.reversals < NOISE_REVERSALS || pp > cap) return;
+
+    int want = std::min(pp + pp / 4, cap); // margin over the observed envelope
+    if (want > ax.noise) {
+        ax.noise = want;
+        ++STATS.noise_raises;
+    } else {
+        ax.noise -= (ax.noise - want) / 8; // jitter got smaller, follow it slowly
+    }
+    ax.last = ax.win_min + pp / 2;
+    dv.noise_dirty = RT.noise_dirty = true;
 }
 
-static int dev_index_by_fd(int fd) {
-    for (size_t i = 0; i < RT.devices.size(); ++i)
-        if (RT.devices[i].fd == fd) return (int)i;
-    return -1;
+// Events the activity check never parsed (after a pulse, or flushed while parked): learn from them
+// and move each axis reference to where the axis ended up, so the next real event isn't measured
+// against a value from before the gap
+static void absorb_batch(Dev& dv, const input_event* buf, int cnt) {
+    for (int i = 0; i < cnt; ++i) {
+        const input_event& e = buf[i];
+        if (e.type != EV_ABS || e.code > ABS_MAX || dv.abs_idx[e.code] == NO_AXIS) continue;
+        AbsAxis& ax = dv.axes[dv.abs_idx[e.code]];
+        if (ABS_ADAPTIVE && !ax.hat) learn_noise(dv, ax, e.value);
+        ax.last = e.value;
+        ax.seen = true;
+    }
 }
 
-static int dev_index_by_path(const std::string& path) {
-    for (size_t i = 0; i < RT.devices.size(); ++i)
-        if (RT.devices[i].path == path) return (int)i;
-    return -1;
+struct NoiseEntry {
+    char id[96];
+    uint8_t code;
+    int floor;
+};
+static std::vector<NoiseEntry> NOISE_DB;
+
+static void device_id(int fd, char* out, size_t n) {
+    input_id id{};
+    char uniq[64] = {};
+    ioctl(fd, EVIOCGID, &id);
+    ioctl(fd, EVIOCGUNIQ(sizeof(uniq) - 1), uniq);
+    for (char* c = uniq; *c; ++c) if (*c == ' ' || *c == '\t' || *c == '\n') *c = '_';
+    snprintf(out, n, "%04x:%04x:%04x:%04x:%s", id.bustype, id.vendor, id.product, id.version, uniq);
+}
+
+// "<id> <abs code> <floor>" per line
+static void load_noise_db() {
+    NOISE_DB.clear();
+    if (NOISE_FILE.empty()) return;
+    FILE* f = fopen(NOISE_FILE.c_str(), "r");
+    if (!f) return;
+    char line[192];
+    while (fgets(line, sizeof(line), f)) {
+        NoiseEntry ne{};
+        unsigned code;
+        if (sscanf(line, "%95s %u %d", ne.id, &code, &ne.floor) != 3 || code > ABS_MAX || ne.floor <= 0) continue;
+        ne.code = (uint8_t)code;
+        NOISE_DB.push_back(ne);
+    }
+    fclose(f);
+}
+
+static void apply_noise_db(Dev& d) {
+    for (auto& ne : NOISE_DB) {
+        if (strcmp(ne.id, d.id) != 0 || d.abs_idx[ne.code] == NO_AXIS) continue;
+        AbsAxis& ax = d.axes[d.abs_idx[ne.code]];
+        const int cap = ax.span > 0 ? (int)(ax.span * NOISE_MAX_PCT) : AXIS_DZ_BADSPAN * 2;
+        ax.noise = std::min(ne.floor, cap);
+    }
+}
+
+static void merge_noise(Dev& d) {
+    if (!d.noise_dirty || !d.id[0]) return;
+    d.noise_dirty = false;
+    for (auto& ax : d.axes) {
+        if (!ax.noise) continue;
+        auto it = std::find_if(NOISE_DB.begin(), NOISE_DB.end(), [&](const NoiseEntry& ne) {
+            return ne.code == ax.code && strcmp(ne.id, d.id) == 0;
+        });
+        if (it == NOISE_DB.end()) {
+            it = NOISE_DB.emplace(NOISE_DB.end());
+            memcpy(it->id, d.id, sizeof(it->id));
+            it->code = ax.code;
+        }
+        it->floor = ax.noise;
+    }
+}
+
+// Rate limited unless forced; tmp + rename so a crash never leaves a torn file
+static void save_noise_db(int64_t now, bool force) {
+    if (!RT.noise_dirty || NOISE_FILE.empty()) return;
+    if (!force && now - RT.noise_saved_ms < NOISE_SAVE_MS) return;
+    for (auto& d : RT.devices) if (d.fd >= 0) merge_noise(d);
+    RT.noise_dirty = false;
+    RT.noise_saved_ms = now;
+
+    const std::string tmp = NOISE_FILE + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) return;
+    for (auto& ne : NOISE_DB) fprintf(f, "%s %u %d\n", ne.id, (unsigned)ne.code, ne.floor);
+    if (fclose(f) == 0) rename(tmp.c_str(), NOISE_FILE.c_str());
+    else unlink(tmp.c_str());
+}
+
+static inline int event_number(const char* name) {
+    return atoi(name + 5); // after is_event_name()
+}
+
+static uint32_t alloc_dev_slot() {
+    if (RT.free_slots.empty()) {
+        RT.devices.emplace_back();
+        return (uint32_t)RT.devices.size() - 1;
+    }
+    uint32_t slot = RT.free_slots.back();
+    RT.free_slots.pop_back();
+    RT.devices[slot] = Dev{};
+    return slot;
+}
+
+static int epoll_dev(int op, uint32_t slot) {
+    epoll_event ev{}; ev.events = EPOLLIN | EPOLLONESHOT; ev.data.u64 = EP_OWNER | EP_DEV | slot;
+    return epoll_ctl(RT.epfd, op, RT.devices[slot].fd, &ev);
 }
 
-static void del_dev_fd(int fd) {
-    int idx = dev_index_by_fd(fd);
-    if (idx >= 0) {
-      epoll_ctl(RT.epfd, EPOLL_CTL_DEL, RT.devices[idx].fd, nullptr);
-      close(RT.devices[idx].fd);
-      RT.devices.erase(RT.devices.begin() + idx);
+static inline void rearm_dev(uint32_t slot) {
+    epoll_dev(EPOLL_CTL_MOD, slot);
+}
+
+static void del_dev_slot(uint32_t slot) {
+    Dev& d = RT.devices[slot];
+    if (d.fd < 0) return;
+    merge_noise(d); // keep what it learned for when it comes back
+    epoll_ctl(RT.epfd, EPOLL_CTL_DEL, d.fd, nullptr);
+    close(d.fd);
+    d.fd = -1;
+    if (d.event_no >= 0 && d.event_no < (int)RT.slot_by_event.size())
+        RT.slot_by_event[d.event_no] = -1;
+    RT.free_slots.push_back(slot);
+}
+
+// ----- capability probing -----
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define NLONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline bool test_bit(const unsigned long* bits, int bit) {
+    return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1UL;
+}
+
+struct DevCaps {
+    unsigned long ev[NLONGS(EV_MAX + 1)];
+    unsigned long key[NLONGS(KEY_MAX + 1)];
+    unsigned long abs[NLONGS(ABS_MAX + 1)];
+    unsigned long prop[NLONGS(INPUT_PROP_MAX + 1)];
+    char name[128];
+    char phys[128];
+};
+
+static void probe_caps(int fd, DevCaps& c) {
+    memset(&c, 0, sizeof(c));
+    ioctl(fd, EVIOCGBIT(0, sizeof(c.ev)), c.ev);
+    if (test_bit(c.ev, EV_KEY)) ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(c.key)), c.key);
+    if (test_bit(c.ev, EV_ABS)) ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(c.abs)), c.abs);
+    ioctl(fd, EVIOCGPROP(sizeof(c.prop)), c.prop); // ENOTTY on old kernels, leaves zeros
+    ioctl(fd, EVIOCGNAME(sizeof(c.name) - 1), c.name);
+    ioctl(fd, EVIOCGPHYS(sizeof(c.phys) - 1), c.phys);
+}
+
+static inline bool is_power_key(int code) {
+    return code == KEY_POWER || code == KEY_POWER2 || code == KEY_SLEEP ||
+           code == KEY_SUSPEND || code == KEY_WAKEUP;
+}
+
+static unsigned classify_dev(const DevCaps& c) {
+    unsigned cls = 0;
+    bool power_keys = false;
+
+    if (test_bit(c.prop, INPUT_PROP_ACCELEROMETER)) cls |= DC_ACCEL;
+    if (test_bit(c.ev, EV_SW)) cls |= DC_SWITCH;
+    if (test_bit(c.ev, EV_REL)) cls |= DC_MOUSE;
+    if (test_bit(c.ev, EV_ABS) && test_bit(c.abs, ABS_MT_POSITION_X)) cls |= DC_TOUCH;
+
+    if (test_bit(c.ev, EV_KEY)) {
+        for (int code = 1; code <= KEY_MAX; ++code) {
+            if (!test_bit(c.key, code)) continue;
+            if (is_power_key(code)) power_keys = true;
+            else if ((code >= BTN_JOYSTICK && code < BTN_DIGI) ||
+                     (code >= BTN_TRIGGER_HAPPY && code <= BTN_TRIGGER_HAPPY40)) cls |= DC_GAMEPAD;
+            else if (code >= BTN_DIGI && code < BTN_WHEEL) cls |= DC_TOUCH;
+            else if (code >= BTN_MOUSE && code < BTN_JOYSTICK) cls |= DC_MOUSE;
+            else cls |= DC_KEYBOARD;
+        }
+    }
+    if (power_keys && !(cls & (DC_KEYBOARD | DC_MOUSE | DC_GAMEPAD | DC_TOUCH))) cls |= DC_POWER;
+    if (!(cls & ~DC_SWITCH)) cls |= DC_OTHER;
+    return cls;
+}
+
+static bool rules_match(const DevRules& r, unsigned cls, const DevCaps& c) {
+    if (r.cls & cls) return true;
+    for (auto& n : r.names) if (strstr(c.name, n.c_str())) return true;
+    for (auto& p : r.phys)  if (strstr(c.phys, p.c_str())) return true;
+    return false;
+}
+
+// Only EV_KEY/EV_REL/EV_ABS ever reach on_activity(), anything else is a wasted fd
+static bool dev_wanted(const DevCaps& c) {
+    if (!test_bit(c.ev, EV_KEY) && !test_bit(c.ev, EV_REL) && !test_bit(c.ev, EV_ABS)) return false;
+    unsigned cls = classify_dev(c);
+    if (rules_match(INPUT_POLICY.allow, cls, c)) return true;
+    return !rules_match(INPUT_POLICY.deny, cls, c);
+}
+
+static inline void set_bit(unsigned long* bits, int bit) {
+    bits[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+// Let only KEY/REL and activity ABS axes through; empty SYN_REPORTs are then dropped by evdev too.
+// Kernels without EVIOCSMASK (< 4.4) fail the ioctl and handle_input() filters in userspace.
+static void install_event_mask(int fd, const DevCaps& c) {
+#ifdef EVIOCSMASK
+    unsigned long types[NLONGS(EV_MAX + 1)] = {};
+    set_bit(types, EV_KEY);
+    set_bit(types, EV_REL);
+    set_bit(types, EV_ABS);
+
+    input_mask m{};
+    m.type = 0; // event type mask
+    m.codes_size = sizeof(types);
+    m.codes_ptr = (uint64_t)(uintptr_t)types;
+    if (ioctl(fd, EVIOCSMASK, &m) < 0) return;
+
+    if (!test_bit(c.ev, EV_ABS)) return;
+    unsigned long axes[NLONGS(ABS_MAX + 1)] = {};
+    for (int code = 0; code <= ABS_MAX; ++code)
+        if (test_bit(c.abs, code) && is_activity_abs(code)) set_bit(axes, code);
+
+    m.type = EV_ABS;
+    m.codes_size = sizeof(axes);
+    m.codes_ptr = (uint64_t)(uintptr_t)axes;
+    ioctl(fd, EVIOCSMASK, &m);
+#else
+    (void)fd; (void)c;
+#endif
+}
+
+static int axis_dz(const AbsAxis& ax) {
+    if (ax.hat) return 0; // HATs are unfiltered
+    int dz;
+    if (ax.span > 0) {
+        dz = (int)std::lround(ax.span * AXIS_DZ_PCT);
+        if (dz < AXIS_DZ_MIN) dz = AXIS_DZ_MIN;
+    } else {
+        dz = AXIS_DZ_BADSPAN; // bad/zero span fallback
     }
+    return dz;
 }
 
-static void init_abs_info(Dev& d) {
+static void add_axis(Dev& d, int code, long span) {
+    d.abs_idx[code] = (uint8_t)d.axes.size();
+    AbsAxis& ax = d.axes.emplace_back();
+    ax.span = span > INT32_MAX ? INT32_MAX : (int)span;
+    ax.code = (uint8_t)code;
+    ax.hat = is_hat_abs(code);
+    ax.dz = axis_dz(ax);
+}
+
+// Probe only the axes set in the EV_ABS bitmap, and only those handle_input() looks at
+static void init_abs_info(Dev& d, const DevCaps& c) {
     auto got_abs = [&](int code, input_absinfo& ai)->bool {
       memset(&ai, 0, sizeof(ai));
       return ioctl(d.fd, EVIOCGABS(code), &ai) == 0;
@@ -393,56 +1436,105 @@ static void init_abs_info(Dev& d) {
     };
 
     // clear (in case of reuse)
-    memset(d.abs_min, 0, sizeof(d.abs_min));
-    memset(d.abs_max, 0, sizeof(d.abs_max));
-    memset(d.abs_dz,  0, sizeof(d.abs_dz));
+    memset(d.abs_idx, NO_AXIS, sizeof(d.abs_idx));
+    d.axes.clear();
+    if (!test_bit(c.ev, EV_ABS)) return;
 
     for (int code = 0; code <= ABS_MAX; ++code) {
+        if (!test_bit(c.abs, code) || !is_activity_abs(code)) continue;
         input_absinfo ai{};
         if (!got_abs(code, ai)) continue;
 
-        d.abs_min[code] = ai.minimum;
-        d.abs_max[code] = ai.maximum;
-
-        if (is_hat_abs(code)) {
-            d.abs_dz[code] = 0; // HATs are unfiltered
-            continue;
-        }
+        add_axis(d, code, span_of(ai));
+    }
+}
 
-      long span = span_of(ai);
-      int dz;
-      if (span > 0) {
-          dz = (int)std::lround(span * AXIS_DZ_PCT);
-          if (dz < AXIS_DZ_MIN) dz = AXIS_DZ_MIN;
-      } else {
-          dz = AXIS_DZ_BADSPAN; // bad/zero span fallback
-      }
-      d.abs_dz[code] = dz;
+// false only if open() failed: the node may not exist yet or udev hasn't set its permissions
+static bool add_dev(int num) {
+    if (num < (int)RT.slot_by_event.size() && RT.slot_by_event[num] >= 0) return true; // already open
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s/event%d", INPUT_DIR, num);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    DevCaps caps;
+    probe_caps(fd, caps);
+    if (!dev_wanted(caps)) { close(fd); return true; }
+    install_event_mask(fd, caps);
+
+    uint32_t slot = alloc_dev_slot();
+    Dev& d = RT.devices[slot];
+    d.fd = fd; d.event_no = num;
+    memcpy(d.name, caps.name, sizeof(d.name) - 1); // truncated, last byte stays 0
+    device_id(fd, d.id, sizeof(d.id));
+    if (epoll_dev(EPOLL_CTL_ADD, slot) < 0) {
+        close(fd); d.fd = -1;
+        RT.free_slots.push_back(slot);
+        return true;
     }
+
+    if (num >= (int)RT.slot_by_event.size()) RT.slot_by_event.resize(num + 1, -1);
+    RT.slot_by_event[num] = (int)slot;
+    init_abs_info(d, caps); // compute per-device stick DZ once
+    apply_noise_db(d);
+    return true;
+}
+
+static inline int64_t retry_delay_ms(int tries) {
+    int64_t ms = (int64_t)HOTPLUG_RETRY_MS << (tries - 1);
+    return ms > HOTPLUG_RETRY_MAX_MS ? HOTPLUG_RETRY_MAX_MS : ms;
 }
 
-static void add_dev(const std::string& path) {
-    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-    if (fd < 0) return;
+static void arm_retry_timer() {
+    int64_t next = 0;
+    for (auto& p : RT.pending) if (next == 0 || p.next_ms < next) next = p.next_ms;
+    set_timer(RT.retry_timer, next);
+}
 
-    epoll_event ev{}; ev.events = EPOLLIN; ev.data.fd = fd;
-    if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) { close(fd); return; }
+static PendingDev* find_pending(int num) {
+    for (auto& p : RT.pending) if (p.num == num) return &p;
+    return nullptr;
+}
+
+static inline void drop_pending(PendingDev* p) {
+    *p = RT.pending.back();
+    RT.pending.pop_back();
+}
+
+// Open now, or queue it for retry_pending() if the node isn't usable yet
+static void hotplug_add(int num, int64_t now) {
+    PendingDev* p = find_pending(num);
+    if (add_dev(num)) {
+        if (p) { drop_pending(p); arm_retry_timer(); }
+        return;
+    }
+    if (p) return; // already backing off
+    RT.pending.push_back({num, 1, now + retry_delay_ms(1)});
+    ++STATS.open_retries;
+    arm_retry_timer();
+}
 
-    Dev d; d.fd = fd; d.path = path;
-    init_abs_info(d); // compute per-device stick DZ once
-    RT.devices.push_back(std::move(d));
+static void hotplug_del(int num) {
+    if (PendingDev* p = find_pending(num)) { drop_pending(p); arm_retry_timer(); }
+    if (num < (int)RT.slot_by_event.size() && RT.slot_by_event[num] >= 0)
+        del_dev_slot((uint32_t)RT.slot_by_event[num]);
 }
 
-static void del_dev(const std::string& path) {
-  int idx = dev_index_by_path(path);
-  if (idx >= 0) {
-      epoll_ctl(RT.epfd, EPOLL_CTL_DEL, RT.devices[idx].fd, nullptr);
-      close(RT.devices[idx].fd);
-      RT.devices.erase(RT.devices.begin() + idx);
-  }
+static void retry_pending(int64_t now) {
+    for (size_t i = 0; i < RT.pending.size(); ) {
+        PendingDev& p = RT.pending[i];
+        if (p.next_ms > now) { ++i; continue; }
+        if (add_dev(p.num)) { drop_pending(&p); continue; }
+        if (p.tries >= HOTPLUG_RETRIES) { ++STATS.open_gave_up; drop_pending(&p); continue; }
+        p.next_ms = now + retry_delay_ms(++p.tries);
+        ++STATS.open_retries;
+        ++i;
+    }
+    arm_retry_timer();
 }
 
-static void scan_inputs() {
+static void scan_inputs(int64_t now) {
     DIR* d = opendir(INPUT_DIR);
     if (!d) die("open %s: %s", INPUT_DIR, strerror(errno));
 
@@ -450,113 +1542,737 @@ static void scan_inputs() {
     while ((e=readdir(d))) {
         if (e->d_name[0] == '.') continue;
         if (!is_event_name(e->d_name)) continue;
-        add_dev(std::string(INPUT_DIR) + "/" + e->d_name);
+        hotplug_add(event_number(e->d_name), now);
     }
     closedir(d);
 }
 
-static void handle_input(int fd, int64_t now) {
-    Dev* dvp = dev_by_fd(fd);
-    if (!dvp) return;
+// ----- netlink uevents -----
+// Kernel messages are "ACTION@DEVPATH\0KEY=VALUE\0...". When udevd runs we listen to its group
+// instead: same properties after a libudev header, sent once rules ran and the node is usable.
+static constexpr uint32_t NL_GROUP_KERNEL = 1;
+static constexpr uint32_t NL_GROUP_UDEV = 2;
+static constexpr uint32_t UDEV_MONITOR_MAGIC = 0xfeedcafe;
+static constexpr size_t   UEVENT_CAPS_MAX = 16;
+
+struct UdevHeader { // libudev monitor_netlink_header, multi-byte fields big-endian
+    char prefix[8]; // "libudev"
+    uint32_t magic;
+    uint32_t header_size;
+    uint32_t properties_off;
+    uint32_t properties_len;
+    uint32_t filter_subsystem_hash;
+    uint32_t filter_devtype_hash;
+    uint32_t filter_tag_bloom_hi;
+    uint32_t filter_tag_bloom_lo;
+};
+
+// inputN parents seen in uevents, consumed when their eventN child shows up
+struct UeventCaps {
+    int input_no;
+    DevCaps caps;
+};
+static std::vector<UeventCaps> UEVENT_CAPS;
+
+// MurmurHash2, as libudev hashes the subsystem into the header
+static uint32_t murmur_hash2(const char* key, size_t len, uint32_t seed) {
+    const uint32_t m = 0x5bd1e995;
+    uint32_t h = seed ^ (uint32_t)len;
+    const unsigned char* data = (const unsigned char*)key;
+    while (len >= 4) {
+        uint32_t k;
+        memcpy(&k, data, 4);
+        k *= m; k ^= k >> 24; k *= m;
+        h *= m; h ^= k;
+        data += 4; len -= 4;
+    }
+    switch (len) {
+      case 3: h ^= data[2] << 16; [[fallthrough]];
+      case 2: h ^= data[1] << 8;  [[fallthrough]];
+      case 1: h ^= data[0]; h *= m;
+    }
+    h ^= h >> 13; h *= m; h ^= h >> 15;
+    return h;
+}
+
+// udev group: only input subsystem messages. Kernel group: only add@/remove@, which drops the
+// stream of change@ events from power_supply and friends; the subsystem is checked after recv.
+static void attach_uevent_filter(int fd, bool udev) {
+    sock_filter udev_prog[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(UdevHeader, magic)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, UDEV_MONITOR_MAGIC, 0, 2),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(UdevHeader, filter_subsystem_hash)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, murmur_hash2("input", 5, 0), 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    };
+    sock_filter kernel_prog[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x61646440, 2, 0), // "add@"
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x72656d6f, 1, 0), // "remo"
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    };
+    sock_fprog prog{};
+    prog.len = udev ? sizeof(udev_prog) / sizeof(udev_prog[0]) : sizeof(kernel_prog) / sizeof(kernel_prog[0]);
+    prog.filter = udev ? udev_prog : kernel_prog;
+    setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)); // unfiltered still works
+}
+
+// false if netlink is unavailable (no permission, seccomp, ...), caller falls back to inotify
+static bool open_uevent_socket() {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return false;
+
+    struct stat st{};
+    RT.nl_udev = stat("/run/udev/control", &st) == 0;
+    attach_uevent_filter(fd, RT.nl_udev);
+
+    int rcvbuf = 1 << 20; // coldplug bursts
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    sockaddr_nl sa{};
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RT.nl_udev ? NL_GROUP_UDEV : NL_GROUP_KERNEL;
+    epoll_event ev{}; ev.events = EPOLLIN; ev.data.u64 = EP_OWNER | (uint32_t)fd;
+    if (bind(fd, (sockaddr*)&sa, sizeof(sa)) < 0 || epoll_ctl(RT.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return false;
+    }
+    RT.nlfd = fd;
+    return true;
+}
+
+// "EV=120013", "KEY=1000 0 ... 0": hex longs, most significant first, as in sysfs capabilities/
+static void parse_cap_bits(const char* s, unsigned long* bits, size_t nlongs) {
+    unsigned long words[NLONGS(KEY_MAX + 1)];
+    size_t n = 0;
+    while (n < sizeof(words) / sizeof(words[0])) {
+        char* end;
+        unsigned long w = strtoul(s, &end, 16);
+        if (end == s) break;
+        words[n++] = w;
+        s = end;
+    }
+    for (size_t i = 0; i < n && i < nlongs; ++i) bits[i] = words[n - 1 - i];
+}
+
+// NAME="..." and PHYS="..." are quoted
+static void copy_unquoted(char* dst, size_t size, const char* v) {
+    if (*v == '"') ++v;
+    size_t len = strlen(v);
+    if (len && v[len - 1] == '"') --len;
+    if (len >= size) len = size - 1;
+    memcpy(dst, v, len);
+    dst[len] = '\0';
+}
+
+// "inputN"/"eventN" component starting at c, -1 if it's something else
+static inline int component_number(const char* c, const char* prefix) {
+    const size_t pl = strlen(prefix);
+    if (strncmp(c, prefix, pl) != 0 || c[pl] < '0' || c[pl] > '9') return -1;
+    return atoi(c + pl);
+}
+
+static void handle_uevent(char* msg, size_t len, int64_t now) {
+    char* p = msg;
+    char* end = msg + len;
+    if (RT.nl_udev) {
+        if (len < sizeof(UdevHeader) || strcmp(msg, "libudev") != 0) return;
+        UdevHeader h;
+        memcpy(&h, msg, sizeof(h));
+        const uint32_t off = ntohl(h.properties_off), plen = ntohl(h.properties_len);
+        if (off < sizeof(UdevHeader) || off > len || plen > len - off) return;
+        p = msg + off; end = p + plen;
+    } else {
+        p += strnlen(msg, len) + 1; // skip "ACTION@DEVPATH"
+    }
+
+    const char *action = nullptr, *devpath = nullptr, *subsystem = nullptr;
+    const char *name = nullptr, *phys = nullptr, *ev = nullptr, *key = nullptr, *abs = nullptr, *prop = nullptr;
+    for (; p < end; p += strlen(p) + 1) {
+        if      (!strncmp(p, "ACTION=", 7))    action = p + 7;
+        else if (!strncmp(p, "DEVPATH=", 8))   devpath = p + 8;
+        else if (!strncmp(p, "SUBSYSTEM=", 10)) subsystem = p + 10;
+        else if (!strncmp(p, "NAME=", 5))      name = p + 5;
+        else if (!strncmp(p, "PHYS=", 5))      phys = p + 5;
+        else if (!strncmp(p, "EV=", 3))        ev = p + 3;
+        else if (!strncmp(p, "KEY=", 4))       key = p + 4;
+        else if (!strncmp(p, "ABS=", 4))       abs = p + 4;
+        else if (!strncmp(p, "PROP=", 5))      prop = p + 5;
+    }
+    if (!action || !devpath || !subsystem || strcmp(subsystem, "input") != 0) return;
+    ++STATS.uevents;
+    const bool add = strcmp(action, "add") == 0;
+    const bool remove = strcmp(action, "remove") == 0;
+
+    const char* leaf = strrchr(devpath, '/');
+    if (!leaf) return;
+    ++leaf;
+
+    int input_no = component_number(leaf, "input");
+    if (input_no >= 0) {
+        auto it = std::find_if(UEVENT_CAPS.begin(), UEVENT_CAPS.end(),
+                               [&](const UeventCaps& u) { return u.input_no == input_no; });
+        if (it != UEVENT_CAPS.end()) UEVENT_CAPS.erase(it);
+        if (!add || !ev) return;
+        if (UEVENT_CAPS.size() >= UEVENT_CAPS_MAX) UEVENT_CAPS.erase(UEVENT_CAPS.begin());
+        UeventCaps& u = UEVENT_CAPS.emplace_back();
+        u.input_no = input_no;
+        memset(&u.caps, 0, sizeof(u.caps));
+        parse_cap_bits(ev, u.caps.ev, NLONGS(EV_MAX + 1));
+        if (key)  parse_cap_bits(key, u.caps.key, NLONGS(KEY_MAX + 1));
+        if (abs)  parse_cap_bits(abs, u.caps.abs, NLONGS(ABS_MAX + 1));
+        if (prop) parse_cap_bits(prop, u.caps.prop, NLONGS(INPUT_PROP_MAX + 1));
+        if (name) copy_unquoted(u.caps.name, sizeof(u.caps.name), name);
+        if (phys) copy_unquoted(u.caps.phys, sizeof(u.caps.phys), phys);
+        return;
+    }
+
+    int num = component_number(leaf, "event");
+    if (num < 0) return;
+    if (remove) { hotplug_del(num); return; }
+    if (!add) return;
+
+    // parent inputN is the component before the leaf
+    const char* parent = leaf - 1;
+    while (parent > devpath && parent[-1] != '/') --parent;
+    if (parent > devpath) {
+        int parent_no = component_number(parent, "input");
+        for (auto it = UEVENT_CAPS.begin(); it != UEVENT_CAPS.end(); ++it) {
+            if (it->input_no != parent_no) continue;
+            const bool wanted = dev_wanted(it->caps);
+            UEVENT_CAPS.erase(it);
+            if (!wanted) { ++STATS.prefiltered; return; }
+            break;
+        }
+    }
+    hotplug_add(num, now);
+}
+
+static void handle_uevents(int64_t now) {
+    char buf[8192];
+    for (;;) {
+        sockaddr_nl sa{};
+        socklen_t sl = sizeof(sa);
+        ssize_t n = recvfrom(RT.nlfd, buf, sizeof(buf) - 1, 0, (sockaddr*)&sa, &sl);
+        if (n < 0) {
+            if (errno == ENOBUFS) { scan_inputs(now); continue; } // lost events, resync
+            break;
+        }
+        if (RT.nl_udev ? sa.nl_pid == 0 : sa.nl_pid != 0) continue; // spoofed or wrong sender
+        buf[n] = '\0';
+        handle_uevent(buf, (size_t)n, now);
+    }
+}
+
+// Activity decision for one batch of events, independent of where they came from
+// (handle_input() or --replay); true once a pulse was produced, the rest of the batch is skipped
+static bool process_events(Dev& dv, const input_event* buf, int cnt, int64_t now) {
+    bool pulsed = false;
+    for (int i = 0; i < cnt; ++i) {
+        const input_event& e = buf[i];
+        if (e.type == EV_SYN) { ++STATS.discarded[EV_SYN]; continue; }
+
+      switch (e.type) {
+          case EV_KEY:
+          case EV_REL:
+              if (on_activity(now)) ++dv.pulses;
+              pulsed = true; break;
+
+        case EV_ABS: {
+            int code = e.code, val = e.value;
+            // non-activity axes have no slot: fallback when EVIOCSMASK is unavailable
+            if (code > ABS_MAX || dv.abs_idx[code] == NO_AXIS) { ++STATS.discarded[EV_ABS]; break; }
+            AbsAxis& ax = dv.axes[dv.abs_idx[code]];
+
+            if (ABS_ADAPTIVE && !ax.hat) learn_noise(dv, ax, val);
+            if (!ax.seen) { ax.last = val; ax.seen = true; break; }
+
+            int delta = std::abs(val - ax.last);
+
+            if (ax.hat) {
+                if (delta != 0) { ax.last = val; if (on_activity(now)) ++dv.pulses; pulsed = true; }
+            } else {
+                int dz = ax.dz; // already per-axis
+                if (dz <= 0) dz = AXIS_DZ_MIN;
+                if (ABS_ADAPTIVE && ax.noise > dz) dz = ax.noise;
+                if (delta >= dz) { ax.last = val; if (on_activity(now)) ++dv.pulses; pulsed = true; }
+                else { ++ax.dz_rejects; ++STATS.dz_rejects; }
+            }
+            break;
+        }
+        default: ++STATS.discarded[e.type < EV_CNT ? e.type : EV_MAX]; break;
+      }
+
+      if (pulsed) { // stop parsing this batch
+          STATS.after_pulse += cnt - i - 1;
+          if (!dv.axes.empty()) absorb_batch(dv, buf + i + 1, cnt - i - 1);
+          break;
+      }
+    }
+    return pulsed;
+}
+
+static void handle_input(uint32_t slot, int64_t now) {
+    if (slot >= RT.devices.size()) return;
+    Dev& dv = RT.devices[slot];
+    const int fd = dv.fd;
+    if (fd < 0) return; // freed earlier in this epoll batch
+    if (RT.parked) return; // stays disarmed, unpark_inputs() flushes it
 
-    Dev& dv = *dvp;
     input_event buf[128]; // bigger buffer to drain faster
     bool pulsed = false; // ensure we only pulse once per batch
+    ++dv.wakeups;
+    ++STATS.input_wakeups;
 
     for (;;) {
         ssize_t n = read(fd, buf, sizeof(buf));
         if (n < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) break; // fully drained
-            del_dev_fd(fd); return; // real error
+            del_dev_slot(slot); return; // real error
         }
-        if (n == 0) { del_dev_fd(fd); return; } // device gone
+        if (n == 0) { del_dev_slot(slot); return; } // device gone
+
+        int cnt = n / sizeof(input_event);
+        dv.bytes += n; dv.events += cnt;
+        STATS.bytes += n; STATS.events += cnt;
 
         if (pulsed) {
+            STATS.after_pulse += cnt;
+            if (!dv.axes.empty()) absorb_batch(dv, buf, cnt);
             continue; // just loop back, we only need to drain buffer
         }
 
-        int cnt = n / sizeof(input_event);
-        for (int i = 0; i < cnt; ++i) {
-            const input_event& e = buf[i];
-            if (e.type == EV_SYN) continue;
+        pulsed = process_events(dv, buf, cnt, now);
 
-          switch (e.type) {
-              case EV_KEY:
-              case EV_REL:
-                  on_activity(now); pulsed = true; break;
+        if (pulsed && RT.parked) return; // pulse accepted, leave the backlog for unpark_inputs()
+    }
+    rearm_dev(slot);
+}
 
-            case EV_ABS: {
-                int code = e.code, val = e.value;
+// Debounce window over: drop whatever queued up while parked and re-arm every device
+static void unpark_inputs() {
+    RT.parked = false;
+    input_event buf[128];
+    for (uint32_t slot = 0; slot < RT.devices.size(); ++slot) {
+        Dev& d = RT.devices[slot];
+        const int fd = d.fd;
+        if (fd < 0) continue;
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            STATS.flushed += n / sizeof(input_event);
+            if (!d.axes.empty()) absorb_batch(d, buf, n / sizeof(input_event));
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) { del_dev_slot(slot); continue; }
+        rearm_dev(slot);
+    }
+}
 
-                if (!dv.abs_seen[code]) { dv.abs_last[code] = val; dv.abs_seen[code] = true; break; }
+// ========== Config reload ==========
+// Re-read the config without touching device handles or the idle clock
+static void reload_config(int64_t now) {
+    const std::string old_mirror = HOOKS_MIRROR;
+    const std::string old_socket = STATE_SOCKET;
+    const bool old_state_file = STATE_FILE_ENABLED;
+    const bool old_hotplug = HOTPLUG_UEVENT;
+    const std::string old_noise_file = NOISE_FILE;
+    const std::string old_battery = BATTERY_RECORD;
 
-                int delta = std::abs(val - dv.abs_last[code]);
+    read_config_or_defaults(RT.idle_s, RT.extended_s);
+    STATE_SOCKET = old_socket; // listener stays where it is until restart
+    HOTPLUG_UEVENT = old_hotplug;
+    NOISE_FILE = old_noise_file; // loaded once at startup
 
-                if (is_hat_abs(code)) {
-                    if (delta != 0) { dv.abs_last[code] = val; on_activity(now); pulsed = true; }
-                } else {
-                    int dz = dv.abs_dz[code]; // already per-axis
-                    if (dz <= 0) dz = AXIS_DZ_MIN;
-                    if (delta >= dz) { dv.abs_last[code] = val; on_activity(now); pulsed = true; }
-                }
-                break;
-            }
-            default: break;
-          }
+    if (HOOKS_MIRROR != old_mirror) {
+        if (!HOOKS_MIRROR.empty()) ensure_hooks_root_layout(HOOKS_MIRROR, false);
+        index_hook_root(1, HOOKS_MIRROR);
+    }
+    if (STATE_FILE_ENABLED && !old_state_file) write_state(RT.state);
+    if (BATTERY_RECORD != old_battery) unmap_battery(0);
+
+    // deadzone and device policy
+    for (uint32_t slot = 0; slot < RT.devices.size(); ++slot) {
+        Dev& d = RT.devices[slot];
+        if (d.fd < 0) continue;
+        DevCaps caps;
+        probe_caps(d.fd, caps);
+        if (!dev_wanted(caps)) { del_dev_slot(slot); continue; }
+        for (auto& ax : d.axes) ax.dz = axis_dz(ax);
+    }
+    scan_inputs(now); // picks up devices the new policy allows
+
+    ++STATS.reloads;
+    schedule_timer(now);
+}
 
-          if (pulsed) break; // stop parsing this batch
+// ========== Trace replay ==========
+// Replay has no devices, timerfds, hooks or state file: timers only keep deadlines, which
+// replay_advance() fires on the simulated clock. Each SYN_REPORT packet counts as one wakeup;
+// packets that arrive while parked would never have been read and count as avoided.
+struct Trace {
+    std::string name;
+    std::vector<std::pair<int, long>> axes; // ABS code, span
+    std::vector<input_event> events;
+    std::vector<int64_t> at_us; // per event, relative to the first
+};
+
+struct ReplayCounts {
+    uint64_t packets{0};
+    uint64_t wakeups{0};
+    uint64_t avoided{0};
+};
+
+// evemu-record format: "N: name", "A: code min max fuzz flat res", "E: sec.usec type code value"
+static bool load_evemu(const char* path, Trace& tr) {
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '\0' || line[1] != ':') continue;
+        if (line[0] == 'N') {
+            char* v = line + 2;
+            while (*v == ' ') ++v;
+            v[strcspn(v, "\r\n")] = '\0';
+            tr.name = v;
+        } else if (line[0] == 'A') {
+            unsigned code; long mn, mx;
+            if (sscanf(line + 2, "%x %ld %ld", &code, &mn, &mx) == 3) tr.axes.emplace_back((int)code, mx - mn);
+        } else if (line[0] == 'E') {
+            long sec, usec; unsigned type, code; int value;
+            if (sscanf(line + 2, "%ld.%ld %x %x %d", &sec, &usec, &type, &code, &value) != 5) continue;
+            input_event e{};
+            e.type = (uint16_t)type; e.code = (uint16_t)code; e.value = value;
+            tr.events.push_back(e);
+            tr.at_us.push_back((int64_t)sec * 1000000 + usec);
         }
     }
+    fclose(f);
+    return true;
 }
 
-int main() {
-    struct sigaction sa{};
-    sa.sa_handler = SIG_DFL;
-    sa.sa_flags = SA_NOCLDWAIT;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGCHLD, &sa, nullptr);
+static void replay_advance(int64_t t) {
+    for (;;) {
+        const int64_t st = RT.state_timer.deadline_ms, dt = RT.debounce_timer.deadline_ms;
+        const bool s_due = st > 0 && st <= t, d_due = dt > 0 && dt <= t;
+        if (!s_due && !d_due) return;
+        if (d_due && (!s_due || dt <= st)) {
+            RT.debounce_timer.deadline_ms = 0;
+            RT.parked = false;
+        } else {
+            RT.state_timer.deadline_ms = 0;
+            reevaluate(st);
+        }
+    }
+}
 
+static void replay_trace(const Trace& tr, ReplayCounts& rc) {
+    RT.state = State::ACTIVE;
+    RT.parked = false;
+    RT.last_activity_ms = 0;
+    RT.last_pulse_ms = -DEBOUNCE_MS;
+    RT.state_timer.deadline_ms = RT.debounce_timer.deadline_ms = 0;
+    STATS = Stats{};
+
+    Dev dv;
+    for (auto& a : tr.axes)
+        if (a.first <= ABS_MAX && is_activity_abs(a.first)) add_axis(dv, a.first, a.second);
+
+    schedule_timer(0);
+    const size_t n = tr.events.size();
+    size_t start = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const input_event& e = tr.events[i];
+        if (!(e.type == EV_SYN && e.code == SYN_REPORT) && i + 1 < n) continue;
+
+        const int64_t t = tr.at_us[i] / 1000 + 1; // >0, deadlines of 0 mean disarmed
+        const int cnt = (int)(i + 1 - start);
+        replay_advance(t);
+        ++rc.packets;
+        if (RT.parked) {
+            ++rc.avoided;
+            STATS.flushed += cnt;
+            if (!dv.axes.empty()) absorb_batch(dv, &tr.events[start], cnt);
+        } else {
+            ++rc.wakeups;
+            STATS.events += cnt;
+            process_events(dv, &tr.events[start], cnt, t);
+        }
+        start = i + 1;
+    }
+
+    // let the idle timers run out after the last event
+    const int64_t end = (n ? tr.at_us[n - 1] / 1000 + 1 : 0) + ((int64_t)RT.idle_s + RT.extended_s) * 1000 + 1;
+    replay_advance(end);
+}
+
+static int replay_main(int argc, char** argv) {
+    int repeat = 1;
+    const char* config = "/dev/null"; // built-in defaults unless --config is given
+    std::vector<const char*> paths;
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) repeat = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) config = argv[++i];
+        else paths.push_back(argv[i]);
+    }
+    if (paths.empty()) die("usage: idlewatcher --replay [--repeat N] [--config FILE] trace.evemu...");
+
+    CONFIG_FILE = config;
+    read_config_or_defaults(RT.idle_s, RT.extended_s);
+    STATE_FILE_ENABLED = false;
+    NOISE_FILE.clear();
+    BATTERY_RECORD.clear(); // the live battery has nothing to do with the trace
+
+    for (const char* path : paths) {
+        Trace tr;
+        if (!load_evemu(path, tr)) die("open %s: %s", path, strerror(errno));
+
+        std::vector<std::pair<int64_t, State>> timeline;
+        ReplayCounts rc;
+        timespec t0{}, t1{};
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r = 0; r < repeat; ++r) {
+            timeline.clear();
+            rc = ReplayCounts{};
+            SIM_TIMELINE = &timeline;
+            replay_trace(tr, rc);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        SIM_TIMELINE = nullptr;
+
+        const double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        const double span = tr.at_us.empty() ? 0.0 : tr.at_us.back() / 1e6;
+        const double total = (double)tr.events.size() * repeat;
+        printf("%s: \"%s\" %zu events over %.3f s\n", path, tr.name.c_str(), tr.events.size(), span);
+        printf("  processed %.0f events/s (%.3f ms for %d run%s)\n",
+               wall > 0 ? total / wall : 0.0, wall * 1000.0, repeat, repeat == 1 ? "" : "s");
+        printf("  packets=%llu wakeups=%llu avoided=%llu (%.1f%%)\n",
+               (unsigned long long)rc.packets, (unsigned long long)rc.wakeups, (unsigned long long)rc.avoided,
+               rc.packets ? 100.0 * rc.avoided / rc.packets : 0.0);
+        printf("  pulses=%llu debounced=%llu dz_rejects=%llu after_pulse=%llu flushed=%llu timer_arms=%llu\n",
+               (unsigned long long)STATS.pulses, (unsigned long long)STATS.debounced,
+               (unsigned long long)STATS.dz_rejects, (unsigned long long)STATS.after_pulse,
+               (unsigned long long)STATS.flushed, (unsigned long long)STATS.timer_arms);
+        printf("  timeline: 0.000 active");
+        for (auto& tl : timeline) printf(", %.3f %s", (tl.first - 1) / 1000.0, state_name(tl.second));
+        printf("\n");
+    }
+    return 0;
+}
+
+// ========== Module ==========
+// main() and knubatd (../Knubatd) drive IdleWatcher through these: whoever owns the loop owns
+// the epoll set and the signals, and hands over every event it doesn't recognise itself
+static void idlewatcher_open(int epfd) {
+    init_hook_spawnattr();
     ensure_hooks_root_layout(HOOKS_ROOT);
     ensure_default_config();
     read_config_or_defaults(RT.idle_s, RT.extended_s);
     if (!HOOKS_MIRROR.empty()) ensure_hooks_root_layout(HOOKS_MIRROR);
+    load_noise_db();
     RT.last_activity_ms = now_ms();
+    RT.suspended_ms = suspended_ms();
+    STATS.started_ms = STATS.state_since = RT.last_activity_ms;
     write_state(State::ACTIVE);
 
     // ======== Event setup ==========
-    RT.epfd = epoll_create1(EPOLL_CLOEXEC);
-    if (RT.epfd < 0) die("epoll_create1: %s", strerror(errno));
+    RT.epfd = epfd;
 
-    RT.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-    if (RT.tfd < 0) die("timerfd_create: %s", strerror(errno));
+    RT.state_timer.fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (RT.state_timer.fd < 0) die("timerfd_create: %s", strerror(errno));
 
     {
       epoll_event tev{};
       tev.events = EPOLLIN;
-      tev.data.fd = RT.tfd;
-      if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, RT.tfd, &tev) < 0)
+      tev.data.u64 = EP_OWNER | (uint32_t)RT.state_timer.fd;
+      if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, RT.state_timer.fd, &tev) < 0)
           die("epoll add tfd: %s", strerror(errno));
     }
 
+    RT.debounce_timer.fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (RT.debounce_timer.fd < 0) die("timerfd_create: %s", strerror(errno));
+
+    {
+      epoll_event dtev{};
+      dtev.events = EPOLLIN;
+      dtev.data.u64 = EP_OWNER | (uint32_t)RT.debounce_timer.fd;
+      if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, RT.debounce_timer.fd, &dtev) < 0)
+          die("epoll add dfd: %s", strerror(errno));
+    }
+
+    RT.hook_timer.fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (RT.hook_timer.fd < 0) die("timerfd_create: %s", strerror(errno));
+
+    {
+      epoll_event htev{};
+      htev.events = EPOLLIN;
+      htev.data.u64 = EP_OWNER | (uint32_t)RT.hook_timer.fd;
+      if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, RT.hook_timer.fd, &htev) < 0)
+          die("epoll add hfd: %s", strerror(errno));
+    }
+
+    RT.retry_timer.fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (RT.retry_timer.fd < 0) die("timerfd_create: %s", strerror(errno));
+
+    {
+      epoll_event rtev{};
+      rtev.events = EPOLLIN;
+      rtev.data.u64 = EP_OWNER | (uint32_t)RT.retry_timer.fd;
+      if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, RT.retry_timer.fd, &rtev) < 0)
+          die("epoll add retry tfd: %s", strerror(errno));
+    }
+
     RT.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
     if (RT.ifd < 0) die("inotify_init1: %s", strerror(errno));
 
-    if (inotify_add_watch(RT.ifd, INPUT_DIR, IN_CREATE | IN_DELETE) < 0)
-        die("inotify_add_watch: %s", strerror(errno));
+    if (!HOTPLUG_UEVENT || !open_uevent_socket()) {
+        RT.input_wd = inotify_add_watch(RT.ifd, INPUT_DIR, IN_CREATE | IN_DELETE);
+        if (RT.input_wd < 0)
+            die("inotify_add_watch: %s", strerror(errno));
+    }
+
+    index_hook_root(0, HOOKS_ROOT);
+    index_hook_root(1, HOOKS_MIRROR);
+
+    // watch the directory, editors replace the file rather than write it in place
+    RT.conf_wd = inotify_add_watch(RT.ifd, HOOKS_ROOT, IN_CLOSE_WRITE | IN_MOVED_TO);
 
     {
       epoll_event iev{};
       iev.events = EPOLLIN;
-      iev.data.fd = RT.ifd;
+      iev.data.u64 = EP_OWNER | (uint32_t)RT.ifd;
       if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, RT.ifd, &iev) < 0)
           die("epoll add ifd: %s", strerror(errno));
     }
 
-    scan_inputs();
+    open_state_socket();
     int64_t startup_now = now_ms();
+    scan_inputs(startup_now);
     schedule_timer(startup_now);
+}
+
+// One ready epoll event; false if the tag isn't one of ours
+static bool idlewatcher_dispatch(uint64_t tag, int64_t now) {
+    if (!(tag & EP_OWNER)) return false;
+    if (tag & EP_DEV) {
+        handle_input((uint32_t)tag, now);
+        return true;
+    }
+    if (tag & EP_HOOK) {
+        reap_hooks(now);
+        return true;
+    }
+    if (tag & EP_CLIENT) {
+        handle_client((int)(uint32_t)tag);
+        return true;
+    }
+    int fd = (int)(uint32_t)tag;
+    if (fd == RT.state_timer.fd) {
+        uint64_t exp;
+        (void)read(RT.state_timer.fd, &exp, sizeof(exp));
+        RT.state_timer.deadline_ms = 0;
+        // the deadline passed while suspended: the key that woke us may not be readable yet, and
+        // going IDLE -> EXTENDED -> ACTIVE in a row would run every hook for nothing
+        if (suspended_ms() - RT.suspended_ms >= SUSPEND_DETECT_MS) {
+            ++STATS.resume_defers;
+            arm_state_timer(now, RESUME_GRACE_MS);
+        } else {
+            reevaluate(now);
+        }
+    } else if (fd == RT.debounce_timer.fd) {
+        uint64_t exp;
+        (void)read(RT.debounce_timer.fd, &exp, sizeof(exp));
+        unpark_inputs();
+    } else if (fd == RT.hook_timer.fd) {
+        uint64_t exp;
+        (void)read(RT.hook_timer.fd, &exp, sizeof(exp));
+        reap_hooks(now);
+    } else if (fd == RT.retry_timer.fd) {
+        uint64_t exp;
+        (void)read(RT.retry_timer.fd, &exp, sizeof(exp));
+        retry_pending(now);
+    } else if (fd == RT.nlfd) {
+        handle_uevents(now);
+    } else if (fd == RT.sfd) {
+        accept_clients(now);
+    } else if (fd == RT.ifd) {
+        static std::vector<char> buf(4096);
+        ssize_t r;
+        while ((r = read(RT.ifd, buf.data(), buf.size())) > 0) {
+            for (char* p = buf.data(); p < buf.data() + r; ) {
+                inotify_event* e = (inotify_event*)p;
+                // overflow comes with wd -1, the same as an unused input_wd/conf_wd (uevent mode)
+                if (e->mask & IN_Q_OVERFLOW) {
+                    hook_dir_event(-1, e->mask);
+                    if (RT.input_wd >= 0) scan_inputs(now);
+                } else if (RT.input_wd >= 0 && e->wd == RT.input_wd) {
+                    if (e->len && is_event_name(e->name)) {
+                        if (e->mask & IN_CREATE) hotplug_add(event_number(e->name), now);
+                        if (e->mask & IN_DELETE) hotplug_del(event_number(e->name));
+                    }
+                } else if (RT.conf_wd >= 0 && e->wd == RT.conf_wd) {
+                    if (e->len && strcmp(e->name, CONFIG_NAME) == 0) RT.reload_pending = true;
+                } else {
+                    hook_dir_event(e->wd, e->mask);
+                }
+                p += sizeof(inotify_event) + e->len;
+            }
+        }
+        refresh_hook_dirs();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// SIGHUP reloads the config, SIGUSR2 dumps counters, SIGTERM/SIGINT save the noise floors (the
+// caller exits afterwards)
+static void idlewatcher_signal(int signo, int64_t now) {
+    if (signo == SIGHUP) RT.reload_pending = true;
+    else if (signo == SIGUSR2) dump_stats(STDERR_FILENO, now);
+    else if (signo == SIGTERM || signo == SIGINT) save_noise_db(now, true);
+}
+
+// Once per epoll_wait() return, after its events
+static void idlewatcher_after_batch(int64_t now) {
+    ++STATS.wakeups;
+    RT.suspended_ms = suspended_ms();
+    if (RT.reload_pending) {
+        RT.reload_pending = false;
+        reload_config(now);
+    }
+    if (RT.noise_dirty) save_noise_db(now, false);
+}
+
+#ifndef KNUBAT_UNIFIED
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0) return replay_main(argc - 2, argv + 2);
+
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigprocmask(SIG_BLOCK, &sigs, nullptr); // delivered through RT.sigfd
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) die("epoll_create1: %s", strerror(errno));
+    idlewatcher_open(epfd);
+
+    RT.sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (RT.sigfd < 0) die("signalfd: %s", strerror(errno));
+
+    {
+      epoll_event sev{};
+      sev.events = EPOLLIN;
+      sev.data.fd = RT.sigfd;
+      if (epoll_ctl(RT.epfd, EPOLL_CTL_ADD, RT.sigfd, &sev) < 0)
+          die("epoll add sigfd: %s", strerror(errno));
+    }
 
-    std::vector<char> buf(4096);
     std::array<epoll_event, 32> events{};
     while (true) {
         int n = epoll_wait(RT.epfd, events.data(), (int)events.size(), -1);
@@ -566,29 +2282,19 @@ int main() {
         }
 
         int64_t batch_now = now_ms();
-
         for (int i = 0; i < n; i++) {
-            int fd = events[i].data.fd;
-            if (fd == RT.tfd) {
-                uint64_t exp;
-                (void)read(RT.tfd, &exp, sizeof(exp));
-                reevaluate(batch_now);
-            } else if (fd == RT.ifd) {
-                ssize_t r;
-                while ((r = read(RT.ifd, buf.data(), buf.size())) > 0) {
-                    for (char* p = buf.data(); p < buf.data() + r; ) {
-                        inotify_event* e = (inotify_event*)p;
-                        if (e->len && is_event_name(e->name)) {
-                            std::string full = std::string(INPUT_DIR) + "/" + e->name;
-                            if (e->mask & IN_CREATE) add_dev(full);
-                            if (e->mask & IN_DELETE) del_dev(full);
-                        }
-                        p += sizeof(inotify_event) + e->len;
-                    }
+            const uint64_t tag = events[i].data.u64;
+            if (tag == (uint64_t)RT.sigfd) {
+                signalfd_siginfo si;
+                while (read(RT.sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                    idlewatcher_signal((int)si.ssi_signo, batch_now);
+                    if (si.ssi_signo == SIGTERM || si.ssi_signo == SIGINT) exit(0);
                 }
             } else {
-                handle_input(fd, batch_now);
+                idlewatcher_dispatch(tag, batch_now);
             }
         }
+        idlewatcher_after_batch(batch_now);
     }
 }
+#endif
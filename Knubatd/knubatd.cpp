@@ -0,0 +1,178 @@
+// knubatd — IdleWatcher and BatteryPlus in one process
+//
+// Copyright (c) 2025 Mikhailzrick
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License version 2
+// as published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License v2
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Optional replacement for running idlewatcher and batteryplus side by side:
+//   both sources are compiled in (each in its own namespace, their main() left out) and run as
+//   modules on one epoll set and one signalfd, so a wakeup that has work for both is one wakeup
+//   and the process carries one copy of libc/libstdc++ state
+//   events are routed by owner bit: each module sets its EP_OWNER bit in the epoll_event.data.u64
+//   of everything it registers (idlewatcher::EP_OWNER, batteryplus::EP_OWNER) and only that module
+//   gets the event; the shared signalfd is knubatd's own and carries no owner bit
+//   each module keeps its config, files, hook directories, hook supervisor and socket, so scripts
+//   and clients can't tell the difference; the standalone binaries still build from the same files
+//   not shared, deliberately: one hook supervisor, one export channel and one set of atomic-write
+//   helpers; both supervisors already wait on the shared epoll set (pidfds, no SIGCHLD), the two
+//   export protocols (IdleWatcher's line socket and state file, BatteryPlus's seqlock record and
+//   socket) have existing clients, and sharing code would need a header outside the single-file
+//   components that each standalone build would then depend on
+//   without a battery BatteryPlus stays out and IdleWatcher runs alone
+//   knubatd --replay ... and knubatd simulate ... are idlewatcher --replay and batteryplus simulate
+//
+// Coupling:
+//   after every batch BatteryPlus is told IdleWatcher's state directly rather than through
+//   IdleWatcher's socket: it backs off sampling in IDLE / EXTENDED and resamples on ACTIVE;
+//   IdleWatcher reads BatteryPlus's shared-memory record for its low battery timeouts either way
+//
+// Signals:
+//   SIGHUP           — IdleWatcher reloads its config
+//   SIGUSR1          — BatteryPlus reset
+//   SIGUSR2          — both dump their counters to stderr
+//   SIGTERM / SIGINT — IdleWatcher saves noise floors, BatteryPlus flushes its maps, exit
+//
+// Build arm: aarch64-linux-gnu-g++ -O3 -flto -std=gnu++20 -Wall -Wextra -pedantic knubatd.cpp -o knubatd
+// Build x86: g++ -O3 -flto -std=gnu++20 -Wall -Wextra -pedantic knubatd.cpp -o knubatd
+
+// Everything both modules include, so none of it ends up inside their namespaces
+#include <algorithm>
+#include <array>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <csignal>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <linux/filter.h>
+#include <linux/input.h>
+#include <linux/netlink.h>
+#include <optional>
+#include <spawn.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define KNUBAT_UNIFIED
+
+namespace idlewatcher {
+#include "../IdleWatcher/idlewatcher.cpp"
+}
+
+namespace batteryplus {
+#include "../BatteryPlus/batteryplus.cpp"
+}
+
+static_assert((idlewatcher::EP_OWNER & batteryplus::EP_OWNER) == 0, "modules need distinct owner bits");
+
+static batteryplus::IdleLevel idle_level(idlewatcher::State s) {
+    switch (s) {
+        case idlewatcher::State::IDLE: return batteryplus::IdleLevel::Idle;
+        case idlewatcher::State::EXTENDED: return batteryplus::IdleLevel::Extended;
+        default: return batteryplus::IdleLevel::Active;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0) return idlewatcher::replay_main(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "simulate") == 0) return batteryplus::run_simulate(argc - 2, argv + 2);
+    if (argc > 1) {
+        fprintf(stderr, "usage: knubatd [--replay ... | simulate ...]\n");
+        return 2;
+    }
+
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigprocmask(SIG_BLOCK, &sigs, nullptr);
+
+    const int epfd = epoll_create1(EPOLL_CLOEXEC);
+    const int sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    epoll_event sev{};
+    sev.events = EPOLLIN;
+    sev.data.fd = sigfd;
+    if (epfd < 0 || sigfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &sev) < 0) {
+        fprintf(stderr, "knubatd: event loop setup failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    idlewatcher::idlewatcher_open(epfd); // exits on failure, as standalone
+    batteryplus::g_idle_socket = false; // same process, no need to subscribe
+    const bool battery = batteryplus::batteryplus_open(epfd);
+    if (!battery) fprintf(stderr, "knubatd: running without BatteryPlus\n");
+
+    std::array<epoll_event, 32> events{};
+    while (true) {
+        int n = epoll_wait(epfd, events.data(), (int)events.size(), -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "knubatd: epoll_wait: %s\n", strerror(errno));
+            return 1;
+        }
+
+        const int64_t now = idlewatcher::now_ms();
+        for (int i = 0; i < n; i++) {
+            const uint64_t tag = events[i].data.u64;
+            if (tag & idlewatcher::EP_OWNER) {
+                idlewatcher::idlewatcher_dispatch(tag, now);
+            } else if (tag & batteryplus::EP_OWNER) {
+                if (battery) batteryplus::batteryplus_dispatch(tag);
+            } else if (tag == (uint64_t)sigfd) {
+                signalfd_siginfo si;
+                while (read(sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                    const int signo = (int)si.ssi_signo;
+                    idlewatcher::idlewatcher_signal(signo, now);
+                    if (signo == SIGTERM || signo == SIGINT) {
+                        if (battery) batteryplus::batteryplus_close();
+                        return 0;
+                    }
+                    if (battery) batteryplus::batteryplus_signal(signo);
+                }
+            }
+        }
+        idlewatcher::idlewatcher_after_batch(now);
+        if (battery) {
+            batteryplus::batteryplus_set_idle(idle_level(idlewatcher::RT.state));
+            batteryplus::batteryplus_after_batch();
+        }
+    }
+}